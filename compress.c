@@ -13,6 +13,10 @@
  *   Mike Frysinger      (vapier@gmail.com)
  */
 
+#ifdef __linux__
+#	define	_GNU_SOURCE	1	/* O_TMPFILE, syncfs(), fallocate()				*/
+#endif
+
 #ifdef _MSC_VER
 #	define	WINDOWS
 #endif
@@ -31,6 +35,8 @@
 #include	<sys/types.h>
 #include	<sys/stat.h>
 #include	<errno.h>
+#include	<time.h>
+#include	<limits.h>
 
 #if !defined(DOS) && !defined(WINDOWS)
 #	include	<dirent.h>
@@ -40,6 +46,67 @@
 #	include	<io.h>
 #endif
 
+#ifdef PTHREADS
+#	include	<pthread.h>
+#endif
+
+#if !defined(AMIGA) && !defined(DOS) && !defined(MINGW) && !defined(WINDOWS)
+#	include	<sys/socket.h>
+#	include	<sys/uio.h>
+#	include	<sys/un.h>
+#	define	DAEMON	1
+#	ifndef MSG_NOSIGNAL
+#		define	MSG_NOSIGNAL	0
+#	endif
+#endif
+
+#ifdef __linux__
+#	include	<linux/perf_event.h>
+#	include	<sys/ioctl.h>
+#	include	<sys/syscall.h>
+#	define	PERF_EVENTS	1
+#endif
+
+#ifdef FALLOC_FL_KEEP_SIZE
+#	define	PREALLOC	1
+#endif
+
+#if defined(CLOCK_MONOTONIC) && !defined(DOS) && !defined(MINGW) && !defined(WINDOWS)
+#	define	RATELIMIT	1
+#endif
+
+#ifdef POSIX_FADV_DONTNEED
+#	define	NOCACHE		1
+#endif
+
+#ifdef SYS_ioprio_set
+#	define	IOPRIO_WHO_PROCESS	1
+#	define	IOPRIO_CLASS_BE		2
+#	define	IOPRIO_CLASS_IDLE	3
+#	define	IOPRIO(class, level)	((class) << 13 | (level))
+#endif
+
+#ifdef __has_include
+#	if __has_include(<sys/sdt.h>)
+#		include	<sys/sdt.h>
+#	endif
+#endif
+
+/*
+ * USDT probes of provider ncompress for bpftrace and the like.  A probe is
+ * a nop and a note in the binary; without <sys/sdt.h> there is nothing.
+ */
+#ifdef DTRACE_PROBE3
+#	define	USDT	1
+#	define	PROBE1(name, a)			DTRACE_PROBE1(ncompress, name, a)
+#	define	PROBE2(name, a, b)		DTRACE_PROBE2(ncompress, name, a, b)
+#	define	PROBE3(name, a, b, c)	DTRACE_PROBE3(ncompress, name, a, b, c)
+#else
+#	define	PROBE1(name, a)
+#	define	PROBE2(name, a, b)
+#	define	PROBE3(name, a, b, c)
+#endif
+
 #ifdef UTIME_H
 #	include	<utime.h>
 #else
@@ -57,6 +124,14 @@
 #	define	chmod(pathname, mode) 0
 #	define	chown(pathname, owner, group) 0
 #	define	utime(pathname, times) 0
+#	define	sync()
+#endif
+
+#ifndef O_TMPFILE
+#	define	fchmod(fd, mode) 0
+#	define	fchown(fd, owner, group) 0
+#	define	futimens(fd, times) ((void)(times), 0)
+#	define	link_output(fd, name) -1
 #endif
 
 #if defined(MINGW) || defined(WINDOWS)
@@ -64,6 +139,8 @@
 #	define open _open
 #	define close _close
 #	define read _read
+#	define lseek _lseek
+#	define ftruncate _chsize
 #	define strdup _strdup
 #	define unlink _unlink
 #	define write _write
@@ -101,9 +178,8 @@ static inline int access(const char *pathname, int mode)
 #define	MAGIC_1		(char_type)'\037'/* First byte of compressed file				*/
 #define	MAGIC_2		(char_type)'\235'/* Second byte of compressed file				*/
 #define BIT_MASK	0x1f			/* Mask for 'number of compresssion bits'		*/
-									/* Masks 0x20 and 0x40 are free.  				*/
-									/* I think 0x20 should mean that there is		*/
-									/* a fourth header byte (for expansion).    	*/
+#define EXT_MODE	0x20			/* A fourth header byte follows: the extended	*/
+									/* format, see below.  Mask 0x40 is free.		*/
 #define BLOCK_MODE	0x80			/* Block compresssion if table is full and		*/
 									/* compression rate is dropping flush tables	*/
 
@@ -114,6 +190,32 @@ static inline int access(const char *pathname, int mode)
 
 #define INIT_BITS 9			/* initial number of bits/code */
 
+/*
+ * The extended format (--index) is only written on request.  Its fourth
+ * header byte holds EXT_INDEX; an unknown value is refused.  The codes are
+ * those of a block mode file, except that a CLEAR is also forced every
+ * SEGSIZE bytes of input, and they end with two CLEARs in a row (each
+ * padded to the end of its group).  A CLEAR starts a segment that can be
+ * decoded on its own, from a byte boundary, so the trailer that follows
+ * the codes lists them:
+ *
+ *		nseg times:	compressed offset (8)	uncompressed offset (8)
+ *					Adler-32 of the segment's uncompressed data (4)
+ *		footer:		nseg (4)	uncompressed size (8)
+ *					Adler-32 of the trailer up to here (4)	"LZWX"
+ *
+ * All numbers are little endian.  Offsets count from the start of the file
+ * and of the data.
+ */
+#define	EXT_INDEX	0x01			/* Codes end in the trailer below				*/
+#define	EXT_SEGSIZ	20				/* Bytes per segment in the trailer				*/
+#define	EXT_FOOTSIZ	20				/* Bytes of the footer							*/
+#define	EXT_MAGIC	"LZWX"
+
+#ifndef SEGSIZE
+#	define	SEGSIZE	(1L*1024*1024)	/* Input between the CLEARs of --index		*/
+#endif
+
 #ifndef SACREDMEM
 	/*
  	 * SACREDMEM is the amount of physical memory saved for others; compress
@@ -131,6 +233,28 @@ static inline int access(const char *pathname, int mode)
 #	define USERMEM 	450000	/* default user memory */
 #endif
 
+#ifndef PREFETCHMEM
+	/*
+	 * PREFETCHMEM is the memory zcat -j may use to hold the output of files
+	 * decoded ahead, shared by all of them.  A file that does not fit is
+	 * streamed once its turn comes.
+	 */
+#	define PREFETCHMEM	(32L*1024*1024)
+#endif
+
+#ifndef BIGOBUFSIZ
+	/*
+	 * BIGOBUFSIZ is the size of the writes uncompress makes to the files it
+	 * creates.
+	 */
+#	define BIGOBUFSIZ	(1L*1024*1024)
+#endif
+
+#define	PREALLOC_MIN	(1L*1024*1024)	/* Smallest output worth reserving		*/
+#define	PREALLOC_RATIO	2				/* Output assumed per byte of input		*/
+#define	SPARSE_BLOCK	4096			/* Unit of the holes of --sparse		*/
+#define	SYNC_BATCH		64				/* Files per sync of --sync				*/
+
 /*
  * machine variants which require cc -Dmachine:  pdp11, z8000, DOS
  */
@@ -174,30 +298,43 @@ static inline int access(const char *pathname, int mode)
 #endif /* BITS */
 
 #ifdef FAST
-#	define	HBITS		17			/* 50% occupancy */
-#	define	HSIZE	   (1<<HBITS)
-#	define	HMASK	   (HSIZE-1)
-#	define	HPRIME		 9941
 #	define	BITS		   16
-#else
-#	if BITS == 16
-#		define HSIZE	69001		/* 95% occupancy */
-#	endif
-#	if BITS == 15
-#		define HSIZE	35023		/* 94% occupancy */
-#	endif
-#	if BITS == 14
-#		define HSIZE	18013		/* 91% occupancy */
-#	endif
-#	if BITS == 13
-#		define HSIZE	9001		/* 91% occupancy */
-#	endif
-#	if BITS <= 12
-#		define HSIZE	5003		/* 80% occupancy */
-#	endif
 #endif
 
+/*
+ * MAXBITS is the widest code width -b and uncompress accept, BITS unless
+ * the build asks for more.  Codes wider than 16 bits (up to 24) need 32 bit
+ * entries in the code table, which slows down compressing with 16 bits,
+ * and other versions of compress cannot read them.
+ */
+#ifndef MAXBITS
+#	define	MAXBITS	BITS
+#endif
+
+#if MAXBITS > 24 || (MAXBITS > 16 && LONG_MAX <= 0x7fffffffL)
+#	error "MAXBITS can be at most 24, and 16 if long has 32 bits"
+#endif
+
+/*
+ * The tables are sized at run time for the code width in use; see
+ * lzw_hsize() for the hash table of the compressor.  The decompressor
+ * needs a prefix and a suffix per code and room for the longest string.
+ */
+#define	DE_HTABSIZ(bits)	((2L<<(bits))/(long)sizeof(count_int)+2)
+
 #define CHECK_GAP 10000
+#define	BEST_TRY	8				/* Shorter phrases --best tries					*/
+#define	BEST_LOOK	512				/* Input --best looks at to end a phrase		*/
+
+#define	NPROBES		4				/* Samples taken by --sample					*/
+#define	PROBESIZ	65536			/* Bytes per sample								*/
+#define	AUTO_PREFIX	(1L*1024*1024)	/* Input -b auto tries the code widths on		*/
+#define	CUTOFF_MIN	1048576			/* Input read before --cutoff may give up		*/
+#define	RATE_BURST	0.25			/* Seconds of --rate-limit the bucket holds		*/
+#define	CACHE_STEP	(4L*1024*1024)	/* Bytes --nocache drops or writes back at once	*/
+#define	CACHE_AHEAD	(8L*1024*1024)	/* Input --nocache asks the kernel to read ahead*/
+#define	RESUME_GAP	(1L*1024*1024)	/* Data between checkpoints of --resume			*/
+#define	RESUME_SUFFIX	".resume"	/* Of the checkpoint next to the output			*/
 
 typedef long int			code_int;
 
@@ -212,23 +349,57 @@ typedef long int			code_int;
 
 typedef	unsigned char	char_type;
 
+#if MAXBITS > 16
+	typedef uint32_t		codetab_int;
+#else
+	typedef unsigned short	codetab_int;
+#endif
+
 #define ARGVAL() (*++(*argv) || (--argc && *++argv))
 
 #define MAXCODE(n)	(1L << (n))
 
-#define	output(b,o,c,n)	{	char_type	*p = &(b)[(o)>>3];					\
-							long		 i = ((long)(c))<<((o)&0x7);		\
-							p[0] |= (char_type)(i);							\
-							p[1] |= (char_type)(i>>8);						\
-							p[2] |= (char_type)(i>>16);						\
-							(o) += (n);										\
-						}
-#define	input(b,o,c,n,m){	char_type 		*p = &(b)[(o)>>3];				\
-							(c) = ((((long)(p[0]))|((long)(p[1])<<8)|		\
-									 ((long)(p[2])<<16))>>((o)&0x7))&(m);	\
-							(o) += (n);										\
+/*
+ * Codes go through a 64 bit buffer which is always moved to and from
+ * memory 8 bytes at a time; the callers make sure that there are 8 bytes
+ * of room to spill into.  Bytes that are not counted in are simply
+ * loaded / stored again the next time round.
+ */
+#define	load_bits(p)	(		 (uint64_t)(p)[0]      | ((uint64_t)(p)[1]<<8)  |	\
+							((uint64_t)(p)[2]<<16) | ((uint64_t)(p)[3]<<24) |	\
+							((uint64_t)(p)[4]<<32) | ((uint64_t)(p)[5]<<40) |	\
+							((uint64_t)(p)[6]<<48) | ((uint64_t)(p)[7]<<56))
+#define	store_bits(p,b)	{	(p)[0] = (char_type)(b);     (p)[1] = (char_type)((b)>>8);	\
+							(p)[2] = (char_type)((b)>>16); (p)[3] = (char_type)((b)>>24);	\
+							(p)[4] = (char_type)((b)>>32); (p)[5] = (char_type)((b)>>40);	\
+							(p)[6] = (char_type)((b)>>48); (p)[7] = (char_type)((b)>>56);	\
 						}
 
+#define	output(o,b,n,c,w)	{	(b) |= ((uint64_t)(c))<<(n);				\
+								(n) += (w);										\
+								store_bits(o, b);								\
+								(o) += (n)>>3;									\
+								(b) >>= (n)&~7;									\
+								(n) &= 7;										\
+							}
+
+/*
+ * Codes are written in groups of 8; a group that is cut short by a change
+ * of code width (or a CLEAR) is padded to its full n_bits bytes.
+ */
+#define group_padding(ngroup, n_bits)	(((8-(ngroup))&7)*(n_bits))
+
+#define	pad_group(o,b,n,ngroup,n_bits)	{									\
+	(n) += group_padding(ngroup, n_bits);						\
+	(ngroup) = 0;												\
+	while ((n) >= 8)											\
+	{															\
+		*(o)++ = (char_type)(b);								\
+		(b) >>= 8;												\
+		(n) -= 8;												\
+	}															\
+}
+
 #define reset_n_bits_for_compressor(n_bits, stcode, free_ent, extcode, maxbits) {	\
 	n_bits = INIT_BITS;								\
 	stcode = 1;									\
@@ -238,9 +409,8 @@ typedef	unsigned char	char_type;
 		extcode++;								\
 }
 
-#define reset_n_bits_for_decompressor(n_bits, bitmask, maxbits, maxcode, maxmaxcode) {	\
+#define reset_n_bits_for_decompressor(n_bits, maxbits, maxcode, maxmaxcode) {	\
 	n_bits = INIT_BITS;								\
-	bitmask = (1<<n_bits)-1;							\
 	if (n_bits == maxbits)								\
 		maxcode = maxmaxcode;							\
 	else										\
@@ -256,30 +426,351 @@ int				keep = 0;			/* Keep input files								*/
 int				nomagic = 0;		/* Use a 3-byte magic number header,			*/
 									/* unless old file 								*/
 int				maxbits = BITS;		/* user settable max # bits/code 				*/
+int				auto_flg = 0;		/* Pick maxbits per file (-b auto)				*/
 int 			zcat_flg = 0;		/* Write output on stdout, suppress messages 	*/
 int				recursive = 0;  	/* compress directories 						*/
+int				compare_flg = 0;	/* Compare two (compressed) files				*/
+const char		*grep_pat = NULL;	/* String to search for (--grep)				*/
+int				concat_flg = 0;		/* Join compressed files into one (--concat)	*/
+int				append_flg = 0;		/* Compress stdin onto a .Z file (--append)		*/
+int				split_n = 0;		/* Pieces to cut a .Z file into (--split)		*/
+int				grep_ret = 1;		/* 0 found, 1 not found, 2 error				*/
+int				jobs = 0;			/* Files zcat decodes ahead (-j)				*/
+int				test_flg = 0;		/* Test compressed files, no output (-t)		*/
+int				sample_flg = 0;		/* Skip files whose samples do not compress		*/
+int				cutoff_flg = 0;		/* Give up when output clearly exceeds input	*/
+long			cutoff_at = 0;		/* Input read when compress() gave up			*/
+int				profile = 0;		/* Count cycles etc. per phase (--profile)		*/
+int				sparse_flg = 0;		/* Leave holes for zero blocks (--sparse)		*/
+int				index_flg = 0;		/* Write the extended format (--index)			*/
+int				best_flg = 0;		/* Flexible parsing (--best)					*/
+int				sync_n = 0;			/* Files per sync of the output (--sync)		*/
+char			**syncq = NULL;		/* Inputs to remove after the next sync			*/
+int				nsyncq = 0;			/* Number of them								*/
+int				nsynced = 0;		/* Files written since the last sync			*/
+char			*syncdir = NULL;	/* Directory of those files						*/
+int				list_flg = 0;		/* List sizes of compressed files (-l)			*/
+FILE			*listfp = NULL;		/* Names of more files (--files-from)			*/
+const char		*listname;			/* Its name, for errors							*/
+int				listsep = '\n';		/* Separator of the names (-0: '\0')			*/
+long			memlimit = 0;		/* Memory for the tables (-M), 0 no limit		*/
+double			rate_limit = 0;		/* I/O bytes per second (--rate-limit), 0 none	*/
+double			rate_tokens;		/* Bytes left in the bucket						*/
+double			rate_last = 0;		/* Time the bucket was last filled				*/
+int				ioprio = -1;		/* I/O priority (--ioprio), -1 unchanged		*/
+int				nocache_flg = 0;	/* Keep files out of the page cache				*/
+int				resume_flg = 0;		/* Checkpoint, and carry on from one (--resume)	*/
+char			*resume_path = NULL;/* Checkpoint of the current output				*/
+int				resume_kept = 0;	/* It is on disk: keep the output on errors		*/
+long			resume_at = 0;		/* Uncompressed offset it was last written at	*/
+long			resume_in = -1;		/* Checkpoint to carry on from: input offset	*/
+long			resume_out;			/* Output offset								*/
+int				resume_best;		/* Written with --best							*/
+int				maxdbits = MAXBITS;	/* Widest codes uncompress accepts				*/
+char			*daemon_path = NULL;/* Socket to serve requests on (--daemon)		*/
+char			*client_path = NULL;/* Socket of a daemon to hand work to (--client)*/
 int				exit_code = -1;		/* Exitcode of compress (-1 no file compressed)	*/
 
 char_type		inbuf[IBUFSIZ+64];	/* Input buffer									*/
 char_type		outbuf[OBUFSIZ+2048];/* Output buffer								*/
+char_type		*bigobuf = NULL;	/* Output buffer for files uncompress creates	*/
 
 struct stat		infstat;			/* Input file status							*/
 char			*ifname;			/* Input filename								*/
 int				remove_ofname = 0;	/* Remove output file on a error				*/
+int				otmp = 0;			/* Output is an O_TMPFILE without a name yet	*/
 char			*ofname = NULL;		/* Output filename								*/
 int				fgnd_flag = 0;		/* Running in background (SIGINT=SIGIGN)		*/
 
 long 			bytes_in;			/* Total number of byte from input				*/
 long 			bytes_out;			/* Total number of byte to output				*/
+#ifdef MEMOSIZE
+long			memo_hits;			/* Successor cache hits of compress()			*/
+#endif
+
+#define	LZW_OK			0	/* Call again with more input or output space	*/
+#define	LZW_END			1	/* Compressor has written all of its output		*/
+#define	LZW_EMAGIC		-1	/* Input is not in compressed format			*/
+#define	LZW_EBITS		-2	/* Input uses more bits than we can handle		*/
+#define	LZW_ECORRUPT	-3	/* Input is corrupt								*/
+#define	LZW_ENOMEM		-4	/* Cannot allocate the tables					*/
+#define	LZW_EFORMAT		-5	/* Input uses an unknown extension				*/
+#define	LZW_EREAD		-6	/* Read error (not from the engine)				*/
+#define	LZW_EWRITE		-7	/* Write error (not from the engine)			*/
+
+#define	ENC_SLACK		64	/* Most output one byte of input can cause		*/
+
+struct lzw_stream
+	{
+		int				 encode;		/* Compressor (1) or decompressor (0)			*/
+		int				 maxbits;		/* Max # bits/code of the stream				*/
+		int				 block_mode;	/* CLEAR code is in use							*/
+		int				 n_bits;		/* Current # bits/code							*/
+		code_int		 free_ent;		/* First unused entry							*/
+		code_int		 maxcode;		/* Compressor: extcode, decompressor: maxcode	*/
+		code_int		 maxmaxcode;	/* Decompressor: should NEVER generate this code*/
+		int				 stcode;		/* Compressor: table is not full yet			*/
+		int				 ratio;			/* Compressor: ratio at last checkpoint			*/
+		long			 checkpoint;	/* Compressor: next ratio check					*/
+		code_int		 ent;			/* Compressor: current prefix (-1 none)			*/
+		code_int		 oldcode;		/* Decompressor: previous code (-1 none)		*/
+		int				 finchar;		/* Decompressor: first char of previous string	*/
+		int				 ngroup;		/* Codes in current group (mod 8)				*/
+		int				 skip;			/* Decompressor: padding bits left to skip		*/
+		int				 test;			/* Decompressor: check the codes, no output		*/
+		uint64_t		 bitbuf;		/* Bits not yet written / decoded				*/
+		int				 bitcnt;		/* Number of bits in bitbuf						*/
+		int				 nhdr;			/* Header bytes written / read					*/
+		int				 hdrlen;		/* Length of the header, 4 if extended			*/
+		char_type		 hdr[4];		/* Header										*/
+		int				 finished;		/* Compressor: last code has been written		*/
+		int				 npend;			/* Compressor: bytes waiting in pend			*/
+		char_type		 pend[ENC_SLACK];
+		char_type		*stackp;		/* Decompressor: rest of the current string		*/
+		long			 bytes_in;		/* Total number of bytes consumed				*/
+		long			 bytes_out;		/* Total number of bytes produced				*/
+		long			 codes;			/* Total number of codes written / read			*/
+		long			 clear_at;		/* Decompressor: input bit of the last CLEAR	*/
+		long			 clear_in;		/* Input offset the codes after the last CLEAR	*/
+		long			 clear_out;		/* and output offset they start at				*/
+		int				 stopclear;		/* Decompressor: return after every CLEAR		*/
+		int				 best;			/* Compressor: flexible parsing (--best)		*/
+		long			 cut;			/* Compressor: bytes_in that ends the phrase	*/
+		int				 lookend;		/* Compressor: look holds the end of the input	*/
+		long			 nlook;			/* Compressor: bytes held in look				*/
+		char_type		 look[2*BEST_LOOK];	/* Compressor: input --best has not coded	*/
+#ifdef MEMOSIZE
+		long			 memo_hits;		/* Compressor: lookups answered by memo			*/
+#endif
+		int				 bitlimit;		/* Decompressor: widest codes accepted			*/
+		long			 hsize;			/* Compressor: entries of the hash table		*/
+		int				 hshift;		/* Compressor: shift of the hash function		*/
+		count_int		*htab;
+		codetab_int		*codetab;
+		long			 nhtab;			/* Entries allocated for htab					*/
+		long			 ncodetab;		/* Entries allocated for codetab				*/
+#ifdef MEMOSIZE
+		uint64_t		 memo[MEMOSIZE];/* Compressor: last successor of a code		*/
+#endif
+		int				 ext;			/* Extended format (--index)					*/
+		long			 nextseg;		/* Compressor: input that forces a CLEAR		*/
+		struct lzw_seg	*seg;			/* Segments so far								*/
+		long			 nseg;
+		long			 maxseg;		/* Entries allocated for seg					*/
+		uint32_t		 sum;			/* Adler-32 of the current segment so far		*/
+		long			 sumseg;		/* Compressor: segment being summed				*/
+		long			 summed;		/* Compressor: input summed so far				*/
+		char_type		 held;			/* Compressor: last byte of input, not summed	*/
+		int				 intail;		/* Decompressor: the codes are over				*/
+		int				 tailok;		/* Decompressor: the trailer has been checked	*/
+		char_type		*tail;			/* Trailer										*/
+		long			 ntail;			/* Its length									*/
+		long			 tailpos;		/* Bytes of it written / read					*/
+	};
+
+struct lzw_seg
+	{
+		long			 coff;			/* Offset in the compressed file				*/
+		long			 uoff;			/* Offset in the data							*/
+		uint32_t		 sum;			/* Adler-32 of the segment						*/
+	};
+
+struct lzw_index						/* Trailer of an extended file					*/
+	{
+		int				 maxbits;
+		long			 usize;			/* Uncompressed size							*/
+		long			 nseg;
+		long			 tstart;		/* Offset of the trailer						*/
+		struct lzw_seg	*seg;
+	};
+
+struct lzw_stream	engine;		/* Engine of compress() and decompress()		*/
+
+struct bits_try							/* A code width tried by -b auto				*/
+	{
+		long				 size;		/* Its output									*/
+		int					 ret;
+	};
+
+struct bits_job							/* Widths one thread of -b auto tries			*/
+	{
+		struct lzw_stream	*z;			/* Stream it tries them with					*/
+		const char_type		*buf;		/* Start of the input							*/
+		long				 len;
+		int					 first;
+		int					 step;
+	};
+
+struct bits_try		btry[MAXBITS+1];	/* Trials of -b auto by code width				*/
+struct lzw_stream	bits_z[MAXBITS+1];	/* Streams of its threads but the first			*/
+char_type			*bits_buf;			/* Input they are run on						*/
+
+#define	CMPBUFSIZ		65536	/* Block size of compare()						*/
+
+struct cmp_side
+	{
+		const char			*name;
+		int					 fd;
+		struct lzw_stream	*z;			/* NULL if the file is not compressed		*/
+		const char_type		*ip;		/* Compressed input not yet uncompressed	*/
+		size_t				 ilen;
+		int					 eof;
+		char_type			*ibuf;
+		char_type			*buf;		/* Uncompressed data						*/
+	};
+
+#define	CONCAT_HOLD		16		/* Bytes held back from the end of a part		*/
+
+struct split_cut						/* A CLEAR --split can cut a file at			*/
+	{
+		long				 at;		/* Bit of the file the CLEAR starts at			*/
+		long				 in;		/* Byte of the file after its padding			*/
+		long				 out;		/* Uncompressed bytes before it					*/
+	};
+
+struct cache_hint						/* A file read or written under --nocache		*/
+	{
+		int					 fd;		/* -1 if no hints are given						*/
+		int					 out;		/* It is written								*/
+		off_t				 off;		/* Offset reached								*/
+		off_t				 mark;		/* Handled up to here, a multiple of CACHE_STEP	*/
+		off_t				 drop;		/* Output dropped up to here					*/
+	};
+
+struct concat_tail						/* End of the part --concat copied last			*/
+	{
+		int					 set;		/* There is one									*/
+		char_type			 buf[CONCAT_HOLD];	/* From the byte its last code ends in	*/
+		int					 len;
+		int					 bits;		/* Bits of buf that belong to its codes			*/
+		int					 skip;		/* Padding the decoder has yet to skip			*/
+		int					 ngroup;	/* Codes in its last group						*/
+		int					 n_bits;	/* Width of its last code						*/
+		int					 grow;		/* The next code is one bit wider				*/
+	};
+
+#define	tab_prefixof(z,i)		(z)->codetab[i]
+#define	tab_suffixof(z,i)		((char_type *)((z)->htab))[i]
+#define	de_stack(z)				((char_type *)&((z)->htab[(z)->nhtab-1]))
+#define	clear_htab(z)			memset((z)->htab, -1, (z)->hsize*sizeof(count_int))
+#define	clear_tab_prefixof(z)	memset((z)->codetab, 0, 256);
+
+/*
+ * In test mode the decompressor keeps the length of every string where the
+ * prefix would be and its first character where the suffix would be.
+ */
+#define	tab_lengthof(z,i)		tab_prefixof(z,i)
+#define	tab_firstof(z,i)		tab_suffixof(z,i)
+
+#ifdef PTHREADS
+#define	MAXJOBS			64		/* Upper limit of -j							*/
+
+#define	PF_WAIT			0		/* Slot has no file assigned					*/
+#define	PF_RUN			1		/* Worker is decoding the file					*/
+#define	PF_READY		2		/* Worker is done; the main thread owns the slot*/
+
+struct prefetch
+	{
+		pthread_t			 thread;
+		pthread_mutex_t		 lock;
+		pthread_cond_t		 cond;
+		int					 state;
+		int					 stop;
+		const char			*name;		/* File to decode						*/
+		int					 valid;		/* Worker decoded a regular file		*/
+		dev_t				 dev;
+		ino_t				 ino;
+		off_t				 offset;	/* Input consumed by z					*/
+		int					 ret;		/* Result of lzw_decode()				*/
+		int					 err;		/* errno of a read error				*/
+		struct lzw_stream	 z;
+		char_type			*ibuf;
+		char_type			*buf;		/* Uncompressed data					*/
+		size_t				 len;
+	};
+
+/*
+ * uncompress -j of an extended file: the threads take the segments in turn.
+ */
+struct segjob
+	{
+		pthread_mutex_t			 lock;
+		int						 fdin;
+		int						 fdout;
+		const struct lzw_index	*ix;
+		long					 next;		/* Next segment to take				*/
+		int						 ret;		/* First error						*/
+		int						 err;		/* Its errno for LZW_EREAD / EWRITE	*/
+	};
+
+struct prefetch	*pftab;				/* Slots of zcat -j								*/
+int				 npf = 0;			/* Number of slots								*/
+size_t			 pfbufsiz;			/* Output buffer size of every slot				*/
+char			**pflist;			/* Files to decode								*/
+long			 pfcount;			/* Number of files								*/
+long			 pfhead;			/* File the main thread is working on			*/
+char			*pfring[MAXJOBS+1];	/* --files-from: names of the files from pfhead	*/
+#endif
+
+#ifdef DAEMON
+/*
+ * Requests of --client to --daemon.  A client sends a daemon_req with its
+ * input and output descriptors attached (SCM_RIGHTS) and gets a daemon_rep
+ * back when the daemon is done.  Without descriptors the data itself goes
+ * over the connection: the client sends its input after the request, shuts
+ * down its side for writing and reads the output until the daemon closes
+ * the connection; there is no reply then.  Both ends are the same binary,
+ * so the structs go over the wire as they are.
+ */
+#define	DAEMON_MAGIC	"LZW1"
+#define	DOP_COMPRESS	0		/* Compress									*/
+#define	DOP_DECOMPRESS	1		/* Uncompress								*/
+#define	DOP_TEST		2		/* Check the input, write nothing			*/
+
+struct daemon_req
+	{
+		char				 magic[4];
+		int					 op;		/* DOP_*								*/
+		int					 bits;		/* Max # bits/code, or widest accepted	*/
+	};
 
-count_int		htab[HSIZE];
-unsigned short	codetab[HSIZE];
+struct daemon_rep
+	{
+		int					 ret;		/* LZW_OK or LZW_E*						*/
+		int					 err;		/* errno of LZW_EREAD / LZW_EWRITE		*/
+		int					 maxbits;	/* Of the input, for LZW_EBITS			*/
+		long				 bytes_in;
+		long				 bytes_out;
+	};
+
+struct daemon_ctx
+	{
+		int					 sock;		/* Listening socket						*/
+		struct lzw_stream	 z;			/* Kept from one request to the next	*/
+		char_type			*ibuf;
+		char_type			*obuf;
+	};
+#endif
 
-#define	tab_prefixof(i)			codetab[i]
-#define	tab_suffixof(i)			((char_type *)(htab))[i]
-#define	de_stack				((char_type *)&(htab[HSIZE-1]))
-#define	clear_htab()			memset(htab, -1, sizeof(htab))
-#define	clear_tab_prefixof()	memset(codetab, 0, 256);
+							/* Phases of --profile								*/
+#define	PROF_NONE		-1
+#define	PROF_SETUP		0	/* Setting up the tables for a file					*/
+#define	PROF_COMPUTE	1	/* The LZW engine, including table clears of CLEAR	*/
+#define	PROF_IO			2	/* read() and write()								*/
+#define	NPHASES			3
+#define	NCOUNTERS		4	/* cycles, instructions, branch and LLC misses		*/
+
+#define	PROF(phase)		{ if (profile) prof_switch(phase); }
+
+int				prof_phase = PROF_NONE;	/* Phase being measured					*/
+int				prof_fd = -1;		/* perf_event group leader						*/
+int				prof_index[NCOUNTERS];/* Position in a group read, -1 if missing	*/
+uint64_t		prof_last[NCOUNTERS];	/* Counters at the last phase switch		*/
+double			prof_last_t;		/* Time at the last phase switch				*/
+uint64_t		prof_count[NPHASES][NCOUNTERS];
+double			prof_time[NPHASES];
+long			prof_bytes;			/* Input of all files							*/
+long			prof_codes;			/* Codes of all files							*/
 
 #ifdef FAST
 static const int primetab[256] =		/* Special secudary hash table.		*/
@@ -321,13 +812,104 @@ static const int primetab[256] =		/* Special secudary hash table.		*/
 
 static void Usage(int);
 static void comprexx(const char *);
-static void compdir(char *);
+static void compdir(char *, void (*)(const char *));
+static char *list_read(void);
+static char *next_name(void);
+static char *dir_of(const char *);
+static int open_output(const char *, int);
+#ifdef O_TMPFILE
+static int link_output(int, const char *);
+#endif
+static void sync_later(const char *);
+static void sync_flush(void);
+static int resume_open(const char *);
+static int resume_seek(struct lzw_stream *, int, int);
+static void resume_point(long, long, int);
+static void resume_end(void);
+static long lzw_hsize(int);
+static long lzw_memory(int, int);
+static int lzw_alloc(struct lzw_stream *, long, long);
+static int lzw_init(struct lzw_stream *, int, int);
+static void lzw_free(struct lzw_stream *);
+static int lzw_extend(struct lzw_stream *);
+static int lzw_segroom(struct lzw_stream *, long);
+static int lzw_addseg(struct lzw_stream *, long, long);
+static void lzw_sum(struct lzw_stream *, const char_type *, long, long);
+static int lzw_tail(struct lzw_stream *, long);
+static int lzw_decode_end(struct lzw_stream *);
+static int lzw_finish_ext(struct lzw_stream *, char_type **);
+static uint32_t adler32(uint32_t, const char_type *, size_t);
+static void put_le(char_type *, uint64_t, int);
+static uint64_t get_le(const char_type *, int);
+static int read_index(int, struct lzw_index *);
+static int lzw_decode_header(struct lzw_stream *);
+static char_type *lzw_drain(struct lzw_stream *, char_type *, char_type *);
+static code_int lzw_lookup(struct lzw_stream *, code_int, int);
+static long lzw_match(struct lzw_stream *, code_int, const char_type *, const char_type *);
+static long lzw_best(struct lzw_stream *, code_int, const char_type *, const char_type *);
+static void lzw_encode_run(struct lzw_stream *, const char_type **, const char_type *,
+							char_type **, char_type *);
+static int lzw_encode(struct lzw_stream *, const char_type *, size_t *, char_type *, size_t *, int);
+static int lzw_decode(struct lzw_stream *, const char_type *, size_t *, char_type *, size_t *);
+static int sample(int, long *, long *);
+static void bits_pick(int, int, struct cache_hint *, struct cache_hint *);
+static void *bits_worker(void *);
+static void bits_one(struct bits_try *, struct lzw_stream *, int, const char_type *, long);
 static void compress(int, int);
 static void decompress(int, int);
+static int prealloc(int, int, long);
+static void write_sparse(int, const char_type *, size_t, long);
+static long cmp_fill(struct cmp_side *);
+static int compare(const char *, const char *);
+static const char_type *grep_find(const char_type *, const char_type *, const char *, size_t);
+static void grep_file(const char *);
+static void grep_path(const char *);
+static int decode_error(const char *, int, const struct lzw_stream *);
+static int concat(char **);
+static int concat_part(int, const char *, struct concat_tail *, int *);
+static int concat_recode(int, const char *, int);
+static void concat_tail_out(int, struct concat_tail *, int);
+static int append(const char *);
+static int append_check(int, long, const char_type *, size_t);
+static int split(const char *);
+static int split_piece(int, const char *, int, long, long);
+#ifdef PTHREADS
+static void prefetch_start(char **, long);
+static const char *prefetch_name(long);
+static void *prefetch_worker(void *);
+static void prefetch_file(struct prefetch *);
+static struct lzw_stream *prefetch_take(int, int, int *);
+static void prefetch_next(void);
+static void prefetch_stop(void);
+static int segment_decode(int, int, const struct lzw_index *);
+static void *segment_worker(void *);
+static int segment_one(struct segjob *, long, struct lzw_stream *, char_type *, char_type *);
+#endif
+#ifdef DAEMON
+static void daemon_run(const char *);
+static void *daemon_worker(void *);
+static void daemon_serve(struct daemon_ctx *, int);
+static void daemon_code(struct daemon_ctx *, struct daemon_req *, int, int, struct daemon_rep *);
+static int daemon_call(int, int, int, int, struct daemon_rep *);
+static int full_write(int, const void *, size_t);
+#endif
 static void read_error(void);
 static void write_error(void);
 static void abort_compress(void);
 static void prratio(FILE *, long, long);
+#ifdef PERF_EVENTS
+static int perf_open(uint64_t, int, int);
+#endif
+static void prof_start(void);
+static double prof_clock(void);
+static void rate_wait(long);
+static void hint_start(struct cache_hint *, int, int);
+static void hint_io(struct cache_hint *, long);
+static void hint_end(struct cache_hint *);
+static void prof_read(uint64_t *, double *);
+static void prof_switch(int);
+static void prof_end(struct lzw_stream *);
+static void prof_report(void);
 static void about(void);
 
 /*****************************************************************
@@ -376,6 +958,11 @@ main(int argc, char *argv[])
 		char **filelist;
 		char **fileptr;
 		int seen_double_dash = 0;
+		int version = 0;
+		char *end;
+		char *name;
+		long n;
+		int shift;
 
 #ifdef SIGINT
 		if ((fgnd_flag = (signal(SIGINT, SIG_IGN)) != SIG_IGN))
@@ -422,9 +1009,34 @@ main(int argc, char *argv[])
 		 * -k => keep input files
      	 * -n => no header: useful to uncompress old files
      	 * -b maxbits => maxbits.  If -b is specified, then maxbits MUST be given also.
+     	 * -b auto => try every maxbits on the start of each file, keep the smallest
      	 * -c => cat all output to stdout
      	 * -C => generate output compatible with compress 2.0.
      	 * -r => recursively compress directories
+     	 * -j => zcat decodes up to N files ahead on threads
+     	 * -t => test the compressed files, write nothing
+     	 * -l => list the sizes of compressed files
+     	 * -M bytes => limit the memory for the tables; picks maxbits
+     	 * --cmp => compare two files like cmp(1), uncompressing .Z files
+     	 * --grep=STRING => write the lines containing STRING, uncompressing .Z files
+     	 * --concat => join the .Z files after the first name into it, without recompressing
+     	 * --append => compress stdin onto the end of a .Z file
+     	 * --split=N => cut a .Z file into up to N .Z files at CLEAR codes
+     	 * --sample => leave files alone whose samples do not compress
+     	 * --cutoff => stop compressing when the output exceeds the input
+     	 * --profile => report cycles, cache misses etc. per phase at exit
+     	 * --sparse => uncompress leaves holes for blocks of zeros
+     	 * --index => write the extended format with a segment index
+     	 * --best => flexible parsing: slower, usually smaller output
+     	 * --daemon=SOCKET => serve requests of --client on SOCKET
+     	 * --client=SOCKET => let the daemon on SOCKET do the work
+     	 * --files-from=FILE => also process the files named in FILE, one per line
+     	 * -0 => the names in FILE end in NUL characters instead
+     	 * --sync[=N] => output is made durable N files at a time before the inputs go
+     	 * --rate-limit=MB => read and write at most MB megabytes per second
+     	 * --ioprio=N|idle => do I/O with best-effort priority N or only when idle
+     	 * --nocache => drop the data from the page cache once read or written
+     	 * --resume => checkpoint, and carry on from the checkpoint of a killed run
      	 * if a string is left, must be an input filename.
      	 */
 
@@ -436,6 +1048,77 @@ main(int argc, char *argv[])
 				continue;
 			}
 
+			if (seen_double_dash == 0 && strncmp(*argv, "--", 2) == 0)
+			{/* A long option */
+				if (strcmp(*argv, "--cmp") == 0)
+					compare_flg = 1;
+				else if (strcmp(*argv, "--concat") == 0)
+					concat_flg = 1;
+				else if (strcmp(*argv, "--append") == 0)
+					append_flg = 1;
+				else if (strncmp(*argv, "--split=", 8) == 0 && atoi(*argv + 8) > 0)
+					split_n = atoi(*argv + 8);
+				else if (strncmp(*argv, "--grep=", 7) == 0 && (*argv)[7] != '\0')
+					grep_pat = *argv + 7;
+				else if (strcmp(*argv, "--sample") == 0)
+					sample_flg = 1;
+				else if (strcmp(*argv, "--cutoff") == 0)
+					cutoff_flg = 1;
+				else if (strcmp(*argv, "--profile") == 0)
+					profile = 1;
+				else if (strcmp(*argv, "--sparse") == 0)
+					sparse_flg = 1;
+				else if (strcmp(*argv, "--index") == 0)
+					index_flg = 1;
+				else if (strcmp(*argv, "--best") == 0)
+					best_flg = 1;
+				else if (strcmp(*argv, "--resume") == 0)
+					resume_flg = 1;
+				else if (strcmp(*argv, "--null") == 0)
+					listsep = '\0';
+				else if (strcmp(*argv, "--sync") == 0)
+					sync_n = SYNC_BATCH;
+				else if (strncmp(*argv, "--sync=", 7) == 0 && atoi(*argv + 7) > 0)
+					sync_n = atoi(*argv + 7);
+				else if (strncmp(*argv, "--files-from=", 13) == 0 && (*argv)[13] != '\0')
+					listname = *argv + 13;
+#ifdef RATELIMIT
+				else if (strncmp(*argv, "--rate-limit=", 13) == 0)
+				{
+					rate_limit = strtod(*argv + 13, &end) * 1048576;
+					if (*end != '\0' || !(rate_limit > 0))
+					{
+						fprintf(stderr, "Bad rate limit: %s\n", *argv + 13);
+						Usage(1);
+					}
+				}
+#endif
+#ifdef NOCACHE
+				else if (strcmp(*argv, "--nocache") == 0)
+					nocache_flg = 1;
+#endif
+#ifdef SYS_ioprio_set
+				else if (strcmp(*argv, "--ioprio=idle") == 0)
+					ioprio = IOPRIO(IOPRIO_CLASS_IDLE, 0);
+				else if (strncmp(*argv, "--ioprio=", 9) == 0 && (*argv)[9] >= '0' &&
+						 (*argv)[9] <= '7' && (*argv)[10] == '\0')
+					ioprio = IOPRIO(IOPRIO_CLASS_BE, (*argv)[9] - '0');
+#endif
+#ifdef DAEMON
+				else if (strncmp(*argv, "--daemon=", 9) == 0 && (*argv)[9] != '\0')
+					daemon_path = *argv + 9;
+				else if (strncmp(*argv, "--client=", 9) == 0 && (*argv)[9] != '\0')
+					client_path = *argv + 9;
+#endif
+				else
+				{
+					fprintf(stderr, "Unknown option: '%s'; ", *argv);
+					Usage(1);
+				}
+
+				continue;
+			}
+
 			if (seen_double_dash == 0 && **argv == '-')
 			{/* A flag argument */
 		    	while (*++(*argv))
@@ -443,7 +1126,7 @@ main(int argc, char *argv[])
 					switch (**argv)
 					{
 			    	case 'V':
-						about();
+						version = 1;
 						break;
 
 					case 's':
@@ -480,13 +1163,72 @@ main(int argc, char *argv[])
 							Usage(1);
 						}
 
-						maxbits = atoi(*argv);
+						if (strcmp(*argv, "auto") == 0)
+							auto_flg = 1;
+						else
+							maxbits = atoi(*argv);
+						goto nextarg;
+
+					case 'M':
+						if (!ARGVAL())
+						{
+							fprintf(stderr, "Missing memory limit\n");
+							Usage(1);
+						}
+
+						errno = 0;
+						memlimit = strtol(*argv, &end, 10);
+						switch (*end)
+						{
+						case 'g': case 'G':	shift = 30;	++end;	break;
+						case 'm': case 'M':	shift = 20;	++end;	break;
+						case 'k': case 'K':	shift = 10;	++end;	break;
+						default:			shift = 0;			break;
+						}
+
+						if (*end != '\0' || errno != 0 || memlimit <= 0 || memlimit > LONG_MAX >> shift)
+						{
+							fprintf(stderr, "Bad memory limit: %s\n", *argv);
+							Usage(1);
+						}
+
+						memlimit <<= shift;
+						goto nextarg;
+
+					case 'j':
+						if (!ARGVAL())
+						{
+							fprintf(stderr, "Missing jobs\n");
+							Usage(1);
+						}
+
+						errno = 0;
+						n = strtol(*argv, &end, 10);
+						if (*end != '\0' || errno != 0 || n < 0 || n > INT_MAX)
+						{
+							fprintf(stderr, "Bad jobs: %s\n", *argv);
+							Usage(1);
+						}
+
+						jobs = (int)n;
 						goto nextarg;
 
 		    		case 'c':
 						zcat_flg = 1;
 						break;
 
+					case 't':
+						do_decomp = zcat_flg = test_flg = 1;
+						break;
+
+					case 'l':
+						do_decomp = zcat_flg = test_flg = list_flg = 1;
+						break;
+
+					case '0':
+						listsep = '\0';
+						break;
+
 			    	case 'q':
 						quiet = 1;
 						break;
@@ -519,80 +1261,321 @@ nextarg:	continue;
     	}
 
     	if (maxbits < INIT_BITS)	maxbits = INIT_BITS;
-    	if (maxbits > BITS) 		maxbits = BITS;
-
-    	if (*filelist != NULL)
-		{
-      		for (fileptr = filelist; *fileptr; fileptr++)
-				comprexx(*fileptr);
-    	}
-		else
-		{/* Standard input */
-			ifname = "";
-			exit_code = 0;
-			remove_ofname = 0;
+    	if (maxbits > MAXBITS) 		maxbits = MAXBITS;
 
-			setmode(0, O_BINARY);
-			setmode(1, O_BINARY);
+		if (memlimit > 0)
+		{/* The widest codes whose tables fit */
+			while (maxbits > INIT_BITS && lzw_memory(1, maxbits) > memlimit)
+				--maxbits;
+			while (maxdbits > INIT_BITS && lzw_memory(0, maxdbits) > memlimit)
+				--maxdbits;
 
-			if (do_decomp == 0)
+			if (lzw_memory(!do_decomp, do_decomp ? maxdbits : maxbits) > memlimit)
 			{
-				compress(0, 1);
+				fprintf(stderr, "%s: -M %ld is too small, %s needs %ld bytes\n",
+						progname, memlimit, do_decomp ? "uncompress" : "compress",
+						lzw_memory(!do_decomp, INIT_BITS));
+				exit(1);
+			}
+		}
 
-				if (zcat_flg == 0 && !quiet)
-				{
-					fprintf(stderr, "Compression: ");
-					prratio(stderr, bytes_in-bytes_out, bytes_in);
-					fprintf(stderr, "\n");
-				}
+#ifdef SYS_ioprio_set
+		if (ioprio != -1 && syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, ioprio) == -1 && !silent)
+			fprintf(stderr, "%s: cannot set the I/O priority: %s\n", progname, strerror(errno));
+#endif
 
-				if (bytes_out >= bytes_in && !(force))
-					exit_code = 2;
+		if (version)
+			about();
+
+		if (listname != NULL)
+		{
+			if (strcmp(listname, "-") == 0)
+				listfp = stdin;
+			else if ((listfp = fopen(listname, "r")) == NULL)
+			{
+				perror(listname);
+				exit(1);
 			}
-			else
-				decompress(0, 1);
+		}
+		else if (listsep == '\0')
+		{
+			fprintf(stderr, "-0 needs --files-from\n");
+			Usage(1);
 		}
 
-		if (recursive && exit_code == -1) {
-			fprintf(stderr, "no files processed after recursive search\n");
+		if (compare_flg)
+		{
+			if (filelist[0] == NULL || (filelist[1] != NULL && filelist[2] != NULL))
+			{
+				fprintf(stderr, "--cmp needs one or two files\n");
+				Usage(1);
+			}
+
+			exit(compare(filelist[0], filelist[1]));
 		}
-		exit((exit_code== -1) ? 1:exit_code);
-	}
 
-void
-Usage(int status)
-	{
-		fprintf(status ? stderr : stdout, "\
-Usage: %s [-dfhvcVr] [-b maxbits] [--] [path ...]\n\
-  --   Halt option processing and treat all remaining args as paths.\n\
-  -d   If given, decompression is done instead.\n\
-  -c   Write output on stdout, don't remove original.\n\
-  -k   Keep input files (do not automatically remove).\n\
-  -b   Parameter limits the max number of bits/code.\n\
-  -f   Forces output file to be generated, even if one already.\n\
-       exists, and even if no space is saved by compressing.\n\
-       If -f is not used, the user will be prompted if stdin is.\n\
-       a tty, otherwise, the output file will not be overwritten.\n\
-  -h   This help output.\n\
-  -v   Write compression statistics.\n\
-  -V   Output version and compile options.\n\
-  -r   Recursive. If a path is a directory, compress everything in it.\n",
-			progname);
+		if (grep_pat != NULL)
+		{
+			if (*filelist == NULL && listfp == NULL)
+				grep_file(NULL);
 
-    		exit(status);
-	}
+			for (fileptr = filelist; *fileptr; fileptr++)
+				grep_path(*fileptr);
 
-void
-comprexx(const char	*fileptr)
-	{
-		int				 fdin = -1;
-		int				 fdout = -1;
-		int				 has_z_suffix;
-		char			*tempname;
-		unsigned long	 namesize = strlen(fileptr);
+			if (listfp != NULL)
+				while ((name = next_name()) != NULL)
+					grep_path(name);
 
-		/* Create a temp buffer to add/remove the .Z suffix. */
-		tempname = malloc(namesize + 3);
+			exit(grep_ret);
+		}
+
+		if (concat_flg)
+		{
+			if (filelist[0] == NULL || filelist[1] == NULL)
+			{
+				fprintf(stderr, "--concat needs an output and at least one file\n");
+				Usage(1);
+			}
+
+			exit(concat(filelist));
+		}
+
+		if (append_flg)
+		{
+			if (filelist[0] == NULL || filelist[1] != NULL)
+			{
+				fprintf(stderr, "--append needs one file\n");
+				Usage(1);
+			}
+
+			exit(append(filelist[0]));
+		}
+
+		if (split_n > 0)
+		{
+			if (filelist[0] == NULL || filelist[1] != NULL)
+			{
+				fprintf(stderr, "--split needs one file\n");
+				Usage(1);
+			}
+
+			exit(split(filelist[0]));
+		}
+
+#ifdef DAEMON
+		if (daemon_path != NULL)
+		{
+			if (filelist[0] != NULL)
+			{
+				fprintf(stderr, "--daemon takes no files\n");
+				Usage(1);
+			}
+
+			daemon_run(daemon_path);
+		}
+#endif
+
+		if (profile)
+			prof_start();
+
+		if (list_flg)
+			printf("%12s %12s %6s %s\n", "compressed", "uncompressed", "ratio",
+					"uncompressed_name");
+
+    	if (*filelist != NULL || listfp != NULL)
+		{
+#ifdef PTHREADS
+			int ahead = (jobs > 1 && do_decomp && zcat_flg && !test_flg && client_path == NULL &&
+						 rate_limit == 0 && !nocache_flg);
+
+			if (ahead && *filelist != NULL)
+				prefetch_start(filelist, fileptr - filelist);
+#endif
+
+      		for (fileptr = filelist; *fileptr; fileptr++)
+			{
+				comprexx(*fileptr);
+#ifdef PTHREADS
+				prefetch_next();
+#endif
+			}
+
+#ifdef PTHREADS
+			prefetch_stop();
+
+			if (ahead && listfp != NULL)
+				prefetch_start(NULL, 0);
+#endif
+
+			if (listfp != NULL)
+			{/* One name at a time, however long the list */
+				while ((name = next_name()) != NULL)
+				{
+					comprexx(name);
+#ifdef PTHREADS
+					prefetch_next();
+#endif
+				}
+
+				if (exit_code == -1)
+					exit_code = 0;		/* An empty list is no error */
+			}
+
+#ifdef PTHREADS
+			prefetch_stop();
+#endif
+    	}
+		else
+		{/* Standard input */
+			ifname = "";
+			exit_code = 0;
+			remove_ofname = 0;
+
+			setmode(0, O_BINARY);
+			setmode(1, O_BINARY);
+
+			if (do_decomp == 0)
+			{
+				compress(0, 1);
+
+				if (zcat_flg == 0 && !quiet)
+				{
+					fprintf(stderr, "Compression: ");
+					prratio(stderr, bytes_in-bytes_out, bytes_in);
+					if (auto_flg)
+						fprintf(stderr, " Bits: %d", engine.maxbits);
+#ifdef MEMOSIZE
+					fprintf(stderr, " Successor cache hits: ");
+					prratio(stderr, memo_hits, bytes_in);
+#endif
+					fprintf(stderr, "\n");
+				}
+
+				if (bytes_out >= bytes_in && !(force))
+					exit_code = 2;
+			}
+			else
+				decompress(0, 1);
+		}
+
+		sync_flush();
+
+		if (recursive && exit_code == -1) {
+			fprintf(stderr, "no files processed after recursive search\n");
+		}
+
+		if (profile)
+			prof_report();
+
+		exit((exit_code== -1) ? 1:exit_code);
+	}
+
+void
+Usage(int status)
+	{
+		fprintf(status ? stderr : stdout, "\
+Usage: %s [-dfhvcVrtl] [-b maxbits|auto] [-M bytes] [-j jobs] [--sample]\n\
+                [--cutoff] [--best] [--rate-limit=mb] [--ioprio=n|idle]\n\
+                [--nocache] [--resume] [--files-from=file [-0]] [--sync[=n]]\n\
+                [--] [path ...]\n\
+       %s --cmp file1 [file2]\n\
+       %s --grep=string [-lr] [--files-from=file [-0]] [path ...]\n\
+       %s --concat [-f] out.Z file.Z ...\n\
+       %s --append file.Z < data\n\
+       %s --split=n [-f] file.Z\n\
+       %s --daemon=socket [-j threads] [-b maxbits] [-M bytes]\n\
+  --   Halt option processing and treat all remaining args as paths.\n\
+  -d   If given, decompression is done instead.\n\
+  -c   Write output on stdout, don't remove original.\n\
+  -k   Keep input files (do not automatically remove).\n\
+  -b   Parameter limits the max number of bits/code.  With auto, compress\n\
+       tries every limit up to the default on the start of each file and\n\
+       keeps the one that comes out smallest (shown by -v).\n\
+  -M   Limit the memory for the tables (suffix k, m or g).  Compress uses\n\
+       the largest maxbits that fits.\n\
+  -j   With -c and -d (zcat), decode up to this many files ahead; with\n\
+       -b auto, try up to this many limits at once.\n\
+  -f   Forces output file to be generated, even if one already.\n\
+       exists, and even if no space is saved by compressing.\n\
+       If -f is not used, the user will be prompted if stdin is.\n\
+       a tty, otherwise, the output file will not be overwritten.\n\
+  -h   This help output.\n\
+  -v   Write compression statistics.\n\
+  -V   Output version and compile options.\n\
+  -r   Recursive. If a path is a directory, compress everything in it.\n\
+  -t   Test compressed files; nothing is written.  With -r only .Z files\n\
+       are tested.\n\
+  -l   List the compressed and uncompressed sizes of compressed files.\n\
+  --sample\n\
+       Leave files unchanged whose samples do not compress.\n\
+  --cutoff\n\
+       Stop compressing a file once the output clearly exceeds the input.\n\
+  --profile\n\
+       Report time and hardware counters per phase at the end.\n\
+  --sparse\n\
+       Uncompress to sparse files: blocks of zeros are left as holes.\n\
+  --index\n\
+       Write the extended format: checksummed segments with an index that\n\
+       lets -j uncompress a file on several threads.\n\
+  --best\n\
+       Look ahead to choose where codes end: usually a few percent smaller\n\
+       output, though mixed binary and text can come out larger, that any\n\
+       uncompress reads, for 4 to 6 times the compression time.\n\
+  --cmp\n\
+       Compare file1 and file2 like cmp(1), uncompressing .Z files on the\n\
+       fly.  With one file, compare file1.Z with file1.\n\
+  --grep=string\n\
+       Write the lines that contain string as file:line:byte:text, like\n\
+       grep -Hnb, uncompressing .Z files on the fly (stdin if no paths).\n\
+       With -l only the names of the files that contain it.\n\
+  --concat\n\
+       Join the compressed files into out.Z, which uncompresses to their\n\
+       contents one after the other.  The codes are copied, not recompressed.\n\
+  --append\n\
+       Compress stdin onto the end of file.Z, which becomes what compressing\n\
+       all of the data at once would give.\n\
+  --split=n\n\
+       Cut file.Z at clear codes into up to n pieces file.1.Z ..., each a\n\
+       compressed file of its own, and list their uncompressed offsets.\n\
+  --daemon=socket\n\
+       Serve the requests of --client on a Unix socket.\n\
+  --client=socket\n\
+       Have the daemon on the socket do the compressing or uncompressing.\n\
+  --files-from=file\n\
+       Also process the paths listed in file (- for stdin), one per line.\n\
+  -0, --null\n\
+       The paths in the --files-from list end in NUL characters.\n\
+  --sync[=n]\n\
+       Give each output file its name only when it is complete, and remove\n\
+       the input files after a sync every n files (default 64).\n\
+  --rate-limit=mb\n\
+       Read and write at most mb megabytes per second, all files together.\n\
+  --ioprio=n|idle\n\
+       Do I/O with best-effort priority n (0 highest, 7 lowest) or only\n\
+       when the disk is otherwise idle (Linux).\n\
+  --nocache\n\
+       Drop the data from the page cache once it has been read or written,\n\
+       so that a huge file does not push everything else out.\n\
+  --resume\n\
+       Checkpoint next to the output while working, and carry on from the\n\
+       checkpoint of a run that was killed.\n",
+			progname, progname, progname, progname, progname, progname, progname);
+
+    		exit(status);
+	}
+
+void
+comprexx(const char	*fileptr)
+	{
+		int				 fdin = -1;
+		int				 fdout = -1;
+		int				 has_z_suffix;
+		int				 replace = 0;
+		char			*tempname;
+		unsigned long	 namesize = strlen(fileptr);
+
+		/* Create a temp buffer to add/remove the .Z suffix. */
+		tempname = malloc(namesize + 3);
 		if (tempname == NULL)
 		{
 			perror("malloc");
@@ -658,7 +1641,7 @@ comprexx(const char	*fileptr)
 		case S_IFDIR:	/* directory */
 #ifdef	RECURSIVE
 		  	if (recursive)
-		    	compdir(tempname);
+		    	compdir(tempname, comprexx);
 		  	else
 #endif
 			if (!quiet)
@@ -668,7 +1651,7 @@ comprexx(const char	*fileptr)
 		case S_IFREG:	/* regular file */
 		  	if (do_decomp != 0)
 			{/* DECOMPRESSION */
-		    	if (!zcat_flg)
+		    	if (!zcat_flg || (test_flg && recursive))
 				{
 					if (!has_z_suffix)
 					{
@@ -718,6 +1701,13 @@ comprexx(const char	*fileptr)
 						return;
 					}
 
+					if (resume_flg && recursive && namesize > strlen(RESUME_SUFFIX) &&
+						strcmp(&tempname[namesize - strlen(RESUME_SUFFIX)], RESUME_SUFFIX) == 0)
+					{/* A checkpoint of ours */
+						free(tempname);
+						return;
+					}
+
 					if (infstat.st_nlink > 1 && (!force))
 					{
 						fprintf(stderr, "%s has %jd other links: unchanged\n",
@@ -742,9 +1732,33 @@ comprexx(const char	*fileptr)
 				goto error;
 	    	}
 
+			if (sample_flg && !do_decomp && !zcat_flg && !force)
+			{
+				long	sin;
+				long	sout;
+
+				if (sample(fdin, &sin, &sout) && sout - sin > sin / 4)
+				{/* Samples grow by more than 25%: leave the file alone */
+					if (!quiet)
+					{
+						fprintf(stderr, "%s: Sampled compression: ", tempname);
+						prratio(stderr, sin-sout, sin);
+						fprintf(stderr, " -- unchanged\n");
+					}
+
+					close(fdin);
+					fdin = -1;
+					exit_code = 2;
+					break;
+				}
+			}
+
     		if (zcat_flg == 0)
 			{
-				if (access(ofname, F_OK) == 0)
+				if (resume_flg)
+					fdout = resume_open(ofname);	/* -1 unless there is a checkpoint */
+
+				if (fdout == -1 && access(ofname, F_OK) == 0)
 				{
 					if (!force)
 					{
@@ -783,19 +1797,11 @@ comprexx(const char	*fileptr)
 		    			}
 					}
 
-					if (unlink(ofname))
-					{
-						fprintf(stderr, "Can't remove old output file\n");
-						perror(ofname);
-						goto error;
-					}
+					replace = 1;
 				}
 
-		    	if ((fdout = open(ofname, O_WRONLY|O_CREAT|O_EXCL|O_BINARY,0600)) == -1)
-				{
-			      	perror(tempname);
+		    	if (fdout == -1 && (fdout = open_output(ofname, replace)) == -1)
 					goto error;
-		    	}
 
 				if(!quiet)
 					fprintf(stderr, "%s: ", tempname);
@@ -809,14 +1815,17 @@ comprexx(const char	*fileptr)
 				remove_ofname = 0;
 			}
 
+			PROBE2(file__start, fileptr, do_decomp);
     		if (do_decomp == 0)
 				compress(fdin, fdout);
     		else
 				decompress(fdin, fdout);
+			PROBE3(file__end, fileptr, bytes_in, bytes_out);
 
+			resume_end();
 			close(fdin);
 
-			if (fdout != 1 && close(fdout))
+			if (fdout != 1 && !otmp && close(fdout))
 				write_error();
 
 			if ( (bytes_in == 0) && (force == 0 ) )
@@ -825,7 +1834,7 @@ comprexx(const char	*fileptr)
 				{
 					if(!quiet)
 						fprintf(stderr, "No compression -- %s unchanged\n", ifname);
-					if (unlink(ofname))	/* Remove input file */
+					if (!otmp && unlink(ofname))	/* Remove input file */
 					{
 						fprintf(stderr, "\nunlink error (ignored) ");
 	    				perror(ofname);
@@ -839,13 +1848,19 @@ comprexx(const char	*fileptr)
     		if (zcat_flg == 0)
 			{
 		    	struct utimbuf	timep;
+				struct timespec	times[2];
 
 		    	if (!do_decomp && bytes_out >= bytes_in && (!force))
 				{/* No compression: remove file.Z */
 					if(!quiet)
-						fprintf(stderr, "No compression -- %s unchanged\n", ifname);
+					{
+						fprintf(stderr, "No compression -- %s unchanged", ifname);
+						if (cutoff_at > 0)
+							fprintf(stderr, " (gave up after %ld bytes)", cutoff_at);
+						fprintf(stderr, "\n");
+					}
 
-			    	if (unlink(ofname))
+			    	if (!otmp && unlink(ofname))
 					{
 						fprintf(stderr, "unlink error (ignored) ");
 						perror(ofname);
@@ -864,6 +1879,12 @@ comprexx(const char	*fileptr)
 						{
 							fprintf(stderr, " Compression: ");
 							prratio(stderr, bytes_in-bytes_out, bytes_in);
+							if (auto_flg)
+								fprintf(stderr, " Bits: %d", engine.maxbits);
+#ifdef MEMOSIZE
+							fprintf(stderr, " Successor cache hits: ");
+							prratio(stderr, memo_hits, bytes_in);
+#endif
 						}
 
 						fprintf(stderr, "\n");
@@ -872,27 +1893,52 @@ comprexx(const char	*fileptr)
 					timep.actime = infstat.st_atime;
 					timep.modtime = infstat.st_mtime;
 
-					if (utime(ofname, &timep))
+					times[0].tv_sec = infstat.st_atime;
+					times[0].tv_nsec = 0;
+					times[1].tv_sec = infstat.st_mtime;
+					times[1].tv_nsec = 0;
+
+					if (otmp ? futimens(fdout, times) : utime(ofname, &timep))
 					{
 						fprintf(stderr, "\nutime error (ignored) ");
 				    	perror(ofname);
 					}
 
-					if (chmod(ofname, infstat.st_mode & 07777))		/* Copy modes */
+					if (otmp ? fchmod(fdout, infstat.st_mode & 07777)	/* Copy modes */
+							 : chmod(ofname, infstat.st_mode & 07777))
 					{
 						fprintf(stderr, "\nchmod error (ignored) ");
 				    	perror(ofname);
 					}
 
-					if (chown(ofname, infstat.st_uid, infstat.st_gid))	/* Copy ownership */
+					if (otmp ? fchown(fdout, infstat.st_uid, infstat.st_gid)	/* Copy ownership */
+							 : chown(ofname, infstat.st_uid, infstat.st_gid))
 					{
 						fprintf(stderr, "\nchown error (ignored) ");
 						perror(ofname);
 					}
 
+					if (otmp)
+					{/* Only now the file gets its name */
+						if (link_output(fdout, ofname))
+						{
+							fprintf(stderr, "Can't link output file\n");
+							perror(ofname);
+							remove_ofname = 0;
+							goto error;
+						}
+
+						otmp = 0;
+						if (close(fdout))
+							write_error();
+						fdout = -1;
+					}
+
 					remove_ofname = 0;
 
-					if (!keep && unlink(ifname))	/* Remove input file */
+					if (sync_n)
+						sync_later(keep ? NULL : ifname);
+					else if (!keep && unlink(ifname))	/* Remove input file */
 					{
 						fprintf(stderr, "\nunlink error (ignored) ");
 	    				perror(ifname);
@@ -900,6 +1946,12 @@ comprexx(const char	*fileptr)
     			}
     		}
 
+			if (otmp)
+			{/* Not kept: the file goes with its descriptor */
+				close(fdout);
+				otmp = 0;
+			}
+
 			if (exit_code == -1)
 				exit_code = 0;
 
@@ -920,10 +1972,12 @@ comprexx(const char	*fileptr)
 		return;
 
 error:
+		resume_end();
 		free(ofname);
 		ofname = NULL;
 		free(tempname);
 		exit_code = 1;
+		otmp = 0;
 		if (fdin != -1)
 			close(fdin);
 		if (fdout != -1)
@@ -932,12 +1986,13 @@ error:
 
 #ifdef	RECURSIVE
 void
-compdir(char *dir)
+compdir(char *dir, void (*fn)(const char *))
 	{
 		struct dirent *dp;
 		DIR *dirp;
 		char					*nptr;
 		char					*fptr;
+		long					 n = 0;
 		unsigned long			 dir_size = strlen(dir);
 		/* The +256 is a lazy optimization. We'll resize on demand. */
 		unsigned long			 size = dir_size + 256;
@@ -962,6 +2017,8 @@ compdir(char *dir)
 			return ;
 		}
 
+		PROBE1(dir__enter, dir);
+
 		while ((dp = readdir(dirp)) != NULL)
 		{
 			if (dp->d_ino == 0)
@@ -984,508 +2041,4922 @@ compdir(char *dir)
 			}
 
 			strcpy(fptr, dp->d_name);
-			comprexx(nptr);
+			fn(nptr);
+			++n;
   		}
 
 		closedir(dirp);
+		PROBE2(dir__exit, dir, n);
 
 		free(nptr);
 	}
 #endif
+
 /*
- * compress fdin to fdout
- *
- * Algorithm:  use open addressing double hashing (no chaining) on the 
- * prefix code / next character combination.  We do a variant of Knuth's
- * algorithm D (vol. 3, sec. 6.4) along with G. Knott's relatively-prime
- * secondary probe.  Here, the modular division first probe is gives way
- * to a faster exclusive-or manipulation.  Also do block compression with
- * an adaptive reset, whereby the code table is cleared when the compression
- * ratio decreases, but after the table fills.  The variable-length output
- * codes are re-sized at this point, and a special CLEAR code is generated
- * for the decompressor.  Late addition:  construct the table according to
- * file size for noticeable speed improvement on small files.  Please direct
- * questions about this implementation to ames!jaw.
+ * The directory a path is in, in a buffer of its own.
  */
-void
-compress(int fdin, int fdout)
+char *
+dir_of(const char *name)
 	{
-		long hp;
-		int rpos;
-		long fc;
-		int outbits;
-		int rlop;
-		int rsize;
-		int stcode;
-		code_int free_ent;
-		int boff;
-		int n_bits;
-		int ratio;
-		long checkpoint;
-		code_int extcode;
-		union
-		{
-			long			code;
-			struct
-			{
-				char_type		c;
-				unsigned short	ent;
-			} e;
-		} fcode;
+		const char	*slash = strrchr(name, '/');
+		char		*dir;
 
-		ratio = 0;
-		checkpoint = CHECK_GAP;
-		reset_n_bits_for_compressor(n_bits, stcode, free_ent, extcode, maxbits);
+		if (slash == NULL)
+			return strdup(".");
+		if (slash == name)
+			return strdup("/");
 
-		memset(outbuf, 0, sizeof(outbuf));
-		bytes_out = 0; bytes_in = 0;
-		outbuf[0] = MAGIC_1;
-		outbuf[1] = MAGIC_2;
-		outbuf[2] = (char)(maxbits | BLOCK_MODE);
-		boff = outbits = (3<<3);
-		fcode.code = 0;
+		if ((dir = malloc(slash - name + 1)) != NULL)
+		{
+			memcpy(dir, name, slash - name);
+			dir[slash - name] = '\0';
+		}
 
-		clear_htab();
+		return dir;
+	}
 
-		while ((rsize = read(fdin, inbuf, IBUFSIZ)) > 0)
+/*
+ * Create the output file name, removing an old one first if replace is set.
+ * With --sync the output is an unnamed O_TMPFILE in the same directory
+ * instead, which link_output() puts in place of the old file once it is
+ * complete; a crash never leaves a partial file under the name.  Not all
+ * file systems have O_TMPFILE, so others get the plain file.
+ */
+int
+open_output(const char *name, int replace)
+	{
+		int		 fd;
+#ifdef O_TMPFILE
+		char	*dir;
+
+		if (sync_n && !resume_flg && (dir = dir_of(name)) != NULL)
 		{
-			if (bytes_in == 0)
+			fd = open(dir, O_TMPFILE|O_WRONLY|O_BINARY, 0600);
+			free(dir);
+
+			if (fd != -1)
 			{
-				fcode.e.ent = inbuf[0];
-				rpos = 1;
+				otmp = 1;
+				return fd;
 			}
-			else
-				rpos = 0;
+		}
+#endif
 
-			rlop = 0;
+		if (replace && unlink(name))
+		{
+			fprintf(stderr, "Can't remove old output file\n");
+			perror(name);
+			return -1;
+		}
 
-			do
-			{
-				if (free_ent >= extcode && fcode.e.ent < FIRST)
-				{
-					if (n_bits < maxbits)
-					{
-						boff = outbits = (outbits-1)+((n_bits<<3)-
-								  	((outbits-boff-1+(n_bits<<3))%(n_bits<<3)));
-						if (++n_bits < maxbits)
-							extcode = MAXCODE(n_bits)+1;
-						else
-							extcode = MAXCODE(n_bits);
-					}
-					else
-					{
-						extcode = MAXCODE(16)+OBUFSIZ;
-						stcode = 0;
-					}
-				}
+		if ((fd = open(name, O_WRONLY|O_CREAT|O_EXCL|O_BINARY, 0600)) == -1)
+			perror(name);
 
-				if (!stcode && bytes_in >= checkpoint && fcode.e.ent < FIRST)
-				{
-					long int rat;
+		return fd;
+	}
 
-					checkpoint = bytes_in + CHECK_GAP;
+#ifdef O_TMPFILE
+/*
+ * Give the O_TMPFILE fd the name.  An existing file of that name is
+ * replaced in one rename(2), so there is always either the old or the
+ * new file.
+ */
+int
+link_output(int fd, const char *name)
+	{
+		char	 path[64];
+		char	*tmp;
+		int		 ret;
+
+		sprintf(path, "/proc/self/fd/%d", fd);
+		if (linkat(AT_FDCWD, path, AT_FDCWD, name, AT_SYMLINK_FOLLOW) == 0)
+			return 0;
+		if (errno != EEXIST || (tmp = malloc(strlen(name) + 32)) == NULL)
+			return -1;
+
+		sprintf(tmp, "%s.%ld~", name, (long)getpid());
+		ret = linkat(AT_FDCWD, path, AT_FDCWD, tmp, AT_SYMLINK_FOLLOW);
+		if (ret == 0 && (ret = rename(tmp, name)) != 0)
+			unlink(tmp);
+
+		free(tmp);
+		return ret;
+	}
+#endif
 
-					if (bytes_in > 0x007fffff)
-					{							/* shift will overflow */
-						rat = (bytes_out+(outbits>>3)) >> 8;
+/*
+ * --sync: note that the output of a file is in place and its input, unless
+ * name is NULL, can go once the output is on disk.  That is made sure of
+ * by one sync for every sync_n files or directory, rather than an fsync(2)
+ * per file.
+ */
+void
+sync_later(const char *name)
+	{
+		char	*dir = dir_of(name != NULL ? name : ofname);
 
-						if (rat == 0)				/* Don't divide by zero */
-							rat = 0x7fffffff;
-						else
-							rat = bytes_in / rat;
-					}
-					else
-						rat = (bytes_in << 8) / (bytes_out+(outbits>>3));	/* 8 fractional bits */
-					if (rat >= ratio)
-						ratio = (int)rat;
-					else
-					{
-						ratio = 0;
-						clear_htab();
-						output(outbuf,outbits,CLEAR,n_bits);
-						boff = outbits = (outbits-1)+((n_bits<<3)-
-								  	((outbits-boff-1+(n_bits<<3))%(n_bits<<3)));
-						reset_n_bits_for_compressor(n_bits, stcode, free_ent, extcode, maxbits);
-					}
-				}
+		if (dir == NULL || (syncdir != NULL && strcmp(dir, syncdir) != 0))
+			sync_flush();
 
-				if (outbits >= (OBUFSIZ<<3))
-				{
-					if (write(fdout, outbuf, OBUFSIZ) != OBUFSIZ)
-						write_error();
+		if (syncdir == NULL)
+			syncdir = dir;
+		else
+			free(dir);
 
-					outbits -= (OBUFSIZ<<3);
-					boff = -(((OBUFSIZ<<3)-boff)%(n_bits<<3));
-					bytes_out += OBUFSIZ;
+		if (syncq == NULL && (syncq = malloc(sync_n * sizeof(*syncq))) == NULL)
+		{
+			perror("malloc");
+			exit(1);
+		}
 
-					memcpy(outbuf, outbuf+OBUFSIZ, (outbits>>3)+1);
-					memset(outbuf+(outbits>>3)+1, '\0', OBUFSIZ);
-				}
+		if (name != NULL && (syncq[nsyncq] = strdup(name)) != NULL)
+			nsyncq++;
 
-				{
-					int i;
+		if (++nsynced >= sync_n)
+			sync_flush();
+	}
 
-					i = rsize-rlop;
+/*
+ * Get the files written since the last sync on disk, then remove their
+ * inputs.  If the sync fails, the inputs stay.
+ */
+void
+sync_flush(void)
+	{
+		int		 ok = 1;
+		int		 i;
+#ifdef __linux__
+		int		 fd;
+#endif
 
-					if ((code_int)i > extcode-free_ent)	i = (int)(extcode-free_ent);
-					if (i > ((sizeof(outbuf) - 32)*8 - outbits)/n_bits)
-						i = ((sizeof(outbuf) - 32)*8 - outbits)/n_bits;
-					
-					if (!stcode && (long)i > checkpoint-bytes_in)
-						i = (int)(checkpoint-bytes_in);
+		if (nsynced == 0)
+			return;
 
-					rlop += i;
-					bytes_in += i;
-				}
+#ifdef __linux__
+		if (syncdir != NULL && (fd = open(syncdir, O_RDONLY)) != -1)
+		{/* Only the file system the files are on */
+			if (syncfs(fd))
+			{
+				fprintf(stderr, "sync error, input files kept: ");
+				perror(syncdir);
+				exit_code = 1;
+				ok = 0;
+			}
 
-				goto next;
-hfound:			fcode.e.ent = codetab[hp];
-next:  			if (rpos >= rlop)
-	   				goto endlop;
-next2: 			fcode.e.c = inbuf[rpos++];
-#ifndef FAST
-				{
-					code_int i;
-					fc = fcode.code;
-					hp = (((long)(fcode.e.c)) << (BITS-8)) ^ (long)(fcode.e.ent);
+			close(fd);
+		}
+		else
+#endif
+			sync();
 
-					if ((i = htab[hp]) == fc)
-						goto hfound;
+		for (i = 0; i < nsyncq; i++)
+		{
+			if (ok && unlink(syncq[i]))	/* Remove input file */
+			{
+				fprintf(stderr, "\nunlink error (ignored) ");
+				perror(syncq[i]);
+			}
 
-					if (i != -1)
+			free(syncq[i]);
+		}
+
+		free(syncdir);
+		syncdir = NULL;
+		nsyncq = 0;
+		nsynced = 0;
+	}
+
+/*
+ * --resume.  After a CLEAR both the compressor and the decompressor start
+ * over, so to carry on from one they need nothing but its offsets in the
+ * input and the output.  Every RESUME_GAP bytes of uncompressed data these
+ * go to a checkpoint next to the output, once the output is written up to
+ * there.  A run that is killed leaves the output and the checkpoint behind,
+ * and the next run with --resume picks up from it.
+ *
+ * Set up the checkpoint of the output name.  If there is one that fits the
+ * input and the options, open the output to carry on and return its
+ * descriptor, else -1.  A checkpoint that does not fit is removed, and the
+ * output is then treated like any other existing file.
+ */
+int
+resume_open(const char *name)
+	{
+		FILE		*f;
+		struct stat	 st;
+		char_type	 hdr[3];
+		char		 mode;
+		long		 in;
+		long		 out;
+		long		 size;
+		long		 mtime;
+		int			 best;
+		int			 bits;
+		int			 fd = -1;
+
+		resume_end();
+		if (!do_decomp && index_flg)
+			return -1;		/* The segments of the index are not kept */
+
+		if ((resume_path = malloc(strlen(name) + sizeof(RESUME_SUFFIX))) == NULL)
+		{
+			perror("malloc");
+			return -1;
+		}
+
+		sprintf(resume_path, "%s%s", name, RESUME_SUFFIX);
+
+		if ((f = fopen(resume_path, "r")) == NULL)
+			return -1;
+
+		if (fscanf(f, "ncompress %c %ld %ld %ld %ld %d %d", &mode, &in, &out, &size, &mtime,
+				   &best, &bits) != 7)
+		{
+			fclose(f);
+			return -1;		/* Not a checkpoint: leave it alone */
+		}
+
+		fclose(f);
+
+		/* The output must be that of the same input with the same options */
+		if (mode == (do_decomp ? 'd' : 'c') && in > 0 && out > 0 &&
+			size == (long)infstat.st_size && mtime == (long)infstat.st_mtime &&
+			stat(name, &st) == 0 && st.st_size >= out &&
+			(do_decomp ? bits >= INIT_BITS && bits <= maxdbits :
+						 best == best_flg && (auto_flg ? bits >= INIT_BITS && bits <= maxbits
+													: bits == maxbits)) &&
+			(fd = open(name, O_RDWR|O_BINARY)) != -1)
+		{
+			if (!do_decomp && (pread(fd, hdr, 3, 0) != 3 ||
+				hdr[0] != MAGIC_1 || hdr[1] != MAGIC_2 ||
+				hdr[2] != (char_type)(bits | BLOCK_MODE)))
+			{
+				close(fd);
+				fd = -1;
+			}
+		}
+
+		if (fd == -1)
+		{
+			if (!quiet)
+				fprintf(stderr, "%s: checkpoint does not fit, removed\n", name);
+			unlink(resume_path);
+			return -1;
+		}
+
+		resume_in = in;
+		resume_out = out;
+		resume_at = do_decomp ? out : in;
+		resume_best = best;
+		resume_kept = 1;
+
+		if (!quiet)
+			fprintf(stderr, "%s: resuming at byte %ld\n", name, do_decomp ? out : in);
+
+		return fd;
+	}
+
+/*
+ * Set up z, fresh from lzw_init(), to carry on from the checkpoint and
+ * seek both files there.  If that cannot be done after all, the checkpoint
+ * is removed and z and the files are set up to start over; returns -1.
+ */
+int
+resume_seek(struct lzw_stream *z, int fdin, int fdout)
+	{
+		char_type	 hdr[3];
+		size_t		 ilen = 3;
+		size_t		 olen = 0;
+		int			 bits;
+
+		if (pread(z->encode ? fdout : fdin, hdr, 3, 0) != 3 ||
+			hdr[0] != MAGIC_1 || hdr[1] != MAGIC_2 || (hdr[2] & EXT_MODE))
+			goto bad;
+
+		if (z->encode)
+		{/* As just after the CLEAR: see lzw_encode_run() */
+			bits = hdr[2] & BIT_MASK;
+			if (!(hdr[2] & BLOCK_MODE) || bits < INIT_BITS || bits > maxbits ||
+				lzw_init(z, 1, bits) != LZW_OK)
+				goto bad;
+
+			z->nhdr = z->hdrlen;
+			z->checkpoint = resume_in + 1 + CHECK_GAP;
+			z->best = resume_best;
+		}
+		else if (lzw_decode(z, hdr, &ilen, outbuf, &olen) != LZW_OK || z->nhdr != z->hdrlen)
+			goto bad;
+
+		z->bytes_in = resume_in;
+		z->bytes_out = resume_out;
+		resume_in = -1;
+
+		if (lseek(fdin, z->bytes_in, SEEK_SET) == -1)
+			read_error();
+		if (lseek(fdout, z->bytes_out, SEEK_SET) == -1 || ftruncate(fdout, z->bytes_out) == -1)
+			write_error();
+		return 0;
+
+bad:
+		fprintf(stderr, "%s: checkpoint %s does not fit, starting over\n", ofname, resume_path);
+		unlink(resume_path);
+		resume_kept = 0;
+		resume_in = -1;
+
+		if (lzw_init(z, z->encode, z->encode ? maxbits : maxdbits) != LZW_OK)
+		{
+			fprintf(stderr, "Cannot allocate memory for %s tables.\n",
+					z->encode ? "compression" : "decompression");
+			abort_compress();
+		}
+
+		z->best = z->encode && best_flg;
+		z->test = !z->encode && test_flg;
+		if (lseek(fdin, 0, SEEK_SET) == -1)
+			read_error();
+		if (lseek(fdout, 0, SEEK_SET) == -1 || ftruncate(fdout, 0) == -1)
+			write_error();
+		return -1;
+	}
+
+/*
+ * The codes after a CLEAR start at offset in of the input and out of the
+ * output, which is written up to there: write a checkpoint if it is time.
+ * bits is the code width of the compressed side.
+ */
+void
+resume_point(long in, long out, int bits)
+	{
+		char	 buf[128];
+		char	*tmp;
+		int		 fd;
+		int		 n;
+		int		 ok;
+
+		if (resume_path == NULL || (do_decomp ? out : in) < resume_at + RESUME_GAP)
+			return;
+
+		n = sprintf(buf, "ncompress %c %ld %ld %ld %ld %d %d\n", do_decomp ? 'd' : 'c', in, out,
+					(long)infstat.st_size, (long)infstat.st_mtime, best_flg, bits);
+
+		/* Renamed into place, so that a kill never leaves half a checkpoint */
+		if ((tmp = malloc(strlen(resume_path) + 2)) == NULL)
+			return;
+		sprintf(tmp, "%s~", resume_path);
+
+		fd = open(tmp, O_WRONLY|O_CREAT|O_TRUNC|O_BINARY, 0600);
+		ok = (fd != -1 && write(fd, buf, n) == n);
+		if (fd != -1 && close(fd))
+			ok = 0;
+
+		if (!ok || rename(tmp, resume_path))
+		{
+			fprintf(stderr, "%s: cannot write checkpoint: ", progname);
+			perror(tmp);
+			if (fd != -1)
+				unlink(tmp);
+			free(resume_path);
+			resume_path = NULL;		/* Carry on without */
+		}
+		else
+		{
+			resume_at = do_decomp ? out : in;
+			resume_kept = 1;
+		}
+
+		free(tmp);
+	}
+
+/*
+ * The file is done with, one way or the other: its checkpoint goes.
+ */
+void
+resume_end(void)
+	{
+		if (resume_path != NULL && resume_kept)
+			unlink(resume_path);
+
+		free(resume_path);
+		resume_path = NULL;
+		resume_kept = 0;
+		resume_at = 0;
+		resume_in = -1;
+	}
+
+/*
+ * Read the next name from the --files-from list into a buffer of its own.
+ * Empty names are skipped; NULL at the end of the list.
+ */
+char *
+list_read(void)
+	{
+		char	*name = NULL;
+		char	*p;
+		size_t	 size = 0;
+		size_t	 len = 0;
+		int		 c;
+
+		for (;;)
+		{
+			c = getc(listfp);
+
+			if (c == EOF || c == listsep)
+			{
+				if (len > 0 || c == EOF)
+					break;
+				continue;
+			}
+
+			if (len + 1 >= size)
+			{
+				size = (size == 0) ? 256 : size * 2;
+				if ((p = realloc(name, size)) == NULL)
+				{
+					fprintf(stderr, "Cannot allocate memory for file list.\n");
+					exit(1);
+				}
+				name = p;
+			}
+
+			name[len++] = (char)c;
+		}
+
+		if (ferror(listfp))
+		{
+			fprintf(stderr, "%s: read error on ", progname);
+			perror(listname);
+			exit(1);
+		}
+
+		if (len == 0)
+		{
+			free(name);
+			return NULL;
+		}
+
+		name[len] = '\0';
+		return name;
+	}
+
+/*
+ * --files-from: the next file to process, or NULL at the end of the list.
+ * Only one name is held at a time, unless zcat -j reads ahead.
+ */
+char *
+next_name(void)
+	{
+		static char	*name = NULL;
+
+#ifdef PTHREADS
+		if (npf > 0)
+			return (char *)prefetch_name(pfhead);
+#endif
+
+		free(name);
+		return name = list_read();
+	}
+
+/*
+ * LZW engine.
+ *
+ * The coder keeps all of its state in a struct lzw_stream so that it can
+ * stop at any byte of input or output and be resumed later, possibly from
+ * another thread.  The calling convention follows zlib: on entry *inlen and
+ * *outlen hold the number of bytes available in / room left in the
+ * buffers, on return they hold the number of bytes consumed / produced.
+ * A stream that returns LZW_OK wants more input or more output space;
+ * nothing is lost by calling it again with an empty input buffer.
+ *
+ * Both directions share the tables of a stream, so one stream can be reused
+ * for any number of files in either direction.  The tables are sized for
+ * the code width of the file and only grow when a wider one comes along.
+ */
+
+/*
+ * Size of the hash table of the compressor for the given code width.
+ */
+long
+lzw_hsize(int bits)
+	{
+#ifdef FAST
+		return 2L << bits;				/* 50% occupancy */
+#else
+		static const long	wide[] =	/* Primes for 95% occupancy		*/
+			{ 137983, 275941, 551909, 1103779, 2207537, 4415069, 8830147, 17660231 };
+
+		if (bits > 16)
+			return wide[bits-17];
+		if (bits == 16)
+			return 69001;				/* 95% occupancy */
+		if (bits == 15)
+			return 35023;				/* 94% occupancy */
+		if (bits == 14)
+			return 18013;				/* 91% occupancy */
+		if (bits == 13)
+			return 9001;				/* 91% occupancy */
+		return 5003;					/* 80% occupancy */
+#endif
+	}
+
+/*
+ * Bytes of tables a stream needs to compress / uncompress with the given
+ * code width.
+ */
+long
+lzw_memory(int encode, int bits)
+	{
+		if (encode)
+			return lzw_hsize(bits) * (long)(sizeof(count_int) + sizeof(codetab_int));
+		else
+			return DE_HTABSIZ(bits) * (long)sizeof(count_int) +
+					(1L << bits) * (long)sizeof(codetab_int);
+	}
+
+/*
+ * Make sure the tables of a stream have at least the given sizes.
+ */
+int
+lzw_alloc(struct lzw_stream *z, long nhtab, long ncodetab)
+	{
+		if (z->nhtab < nhtab)
+		{
+			free(z->htab);
+			z->htab = malloc(nhtab * sizeof(count_int));
+			z->nhtab = (z->htab != NULL) ? nhtab : 0;
+		}
+
+		if (z->ncodetab < ncodetab)
+		{
+			free(z->codetab);
+			z->codetab = malloc(ncodetab * sizeof(codetab_int));
+			z->ncodetab = (z->codetab != NULL) ? ncodetab : 0;
+		}
+
+		return (z->htab != NULL && z->codetab != NULL) ? LZW_OK : LZW_ENOMEM;
+	}
+
+/*
+ * Reset a stream for a new compressed or uncompressed file.  bits is the
+ * code width to compress with, or the widest code width to accept when
+ * uncompressing (0 for BITS).  The tables of the stream are kept.
+ */
+int
+lzw_init(struct lzw_stream *z, int encode, int bits)
+	{
+		count_int		*htab = z->htab;
+		codetab_int		*codetab = z->codetab;
+		long			 nhtab = z->nhtab;
+		long			 ncodetab = z->ncodetab;
+		struct lzw_seg	*seg = z->seg;
+		long			 maxseg = z->maxseg;
+
+		free(z->tail);
+		memset(z, 0, sizeof(*z));
+		z->htab = htab;
+		z->codetab = codetab;
+		z->nhtab = nhtab;
+		z->ncodetab = ncodetab;
+		z->seg = seg;
+		z->maxseg = maxseg;
+
+		z->encode = encode;
+		z->ent = -1;
+		z->oldcode = -1;
+		z->bitlimit = (bits != 0) ? bits : BITS;
+		z->hdrlen = 3;
+		z->nextseg = LONG_MAX;
+
+		if (encode)
+		{
+			z->hsize = lzw_hsize(bits);
+#ifdef FAST
+			z->hshift = bits+1-8;
+#else
+			z->hshift = bits-8;
+#endif
+			if (lzw_alloc(z, z->hsize, z->hsize) != LZW_OK)
+				return LZW_ENOMEM;
+
+			z->maxbits = bits;
+			z->block_mode = BLOCK_MODE;
+			z->checkpoint = CHECK_GAP;
+			reset_n_bits_for_compressor(z->n_bits, z->stcode, z->free_ent, z->maxcode, z->maxbits);
+			clear_htab(z);
+
+			z->hdr[0] = MAGIC_1;
+			z->hdr[1] = MAGIC_2;
+			z->hdr[2] = (char_type)(bits | BLOCK_MODE);
+		}
+
+		return LZW_OK;
+	}
+
+/*
+ * Release the tables of a stream.
+ */
+void
+lzw_free(struct lzw_stream *z)
+	{
+		free(z->htab);
+		free(z->codetab);
+		free(z->seg);
+		free(z->tail);
+		z->htab = NULL;
+		z->codetab = NULL;
+		z->seg = NULL;
+		z->tail = NULL;
+		z->nhtab = 0;
+		z->ncodetab = 0;
+		z->maxseg = 0;
+	}
+
+/*
+ * Make the compressor z, fresh from lzw_init(), write the extended format.
+ */
+int
+lzw_extend(struct lzw_stream *z)
+	{
+		z->ext = 1;
+		z->hdrlen = 4;
+		z->hdr[2] |= EXT_MODE;
+		z->hdr[3] = EXT_INDEX;
+		z->nextseg = SEGSIZE;
+		z->sum = 1;
+
+		return lzw_addseg(z, z->hdrlen, 0);
+	}
+
+/*
+ * Make room for n more segments.
+ */
+int
+lzw_segroom(struct lzw_stream *z, long n)
+	{
+		struct lzw_seg	*seg;
+
+		if (z->maxseg - z->nseg < n)
+		{
+			if ((seg = realloc(z->seg, (z->nseg + n + 64) * sizeof(*seg))) == NULL)
+				return LZW_ENOMEM;
+
+			z->seg = seg;
+			z->maxseg = z->nseg + n + 64;
+		}
+
+		return LZW_OK;
+	}
+
+/*
+ * Start a new segment at offset coff of the file and uoff of the data.
+ */
+int
+lzw_addseg(struct lzw_stream *z, long coff, long uoff)
+	{
+		if (lzw_segroom(z, 1) != LZW_OK)
+			return LZW_ENOMEM;
+
+		z->seg[z->nseg].coff = coff;
+		z->seg[z->nseg].uoff = uoff;
+		z->seg[z->nseg].sum = 0;
+		++z->nseg;
+		return LZW_OK;
+	}
+
+/*
+ * Compressor: add the input from offset z->summed up to end to the sums of
+ * the segments it falls in.  buf holds the input from offset from on.
+ */
+void
+lzw_sum(struct lzw_stream *z, const char_type *buf, long from, long end)
+	{
+		long	lim;
+
+		for (;;)
+		{
+			if (z->sumseg+1 < z->nseg && z->summed == z->seg[z->sumseg+1].uoff)
+			{
+				z->seg[z->sumseg++].sum = z->sum;
+				z->sum = 1;
+				continue;
+			}
+
+			if (z->summed >= end)
+				break;
+
+			lim = end;
+			if (z->sumseg+1 < z->nseg && z->seg[z->sumseg+1].uoff < lim)
+				lim = z->seg[z->sumseg+1].uoff;
+
+			z->sum = adler32(z->sum, buf + (z->summed - from), lim - z->summed);
+			z->summed = lim;
+		}
+	}
+
+/*
+ * Compressor: end the codes of the extended format with two CLEARs and
+ * build the trailer.  The last code has just been put in the bit buffer.
+ */
+int
+lzw_finish_ext(struct lzw_stream *z, char_type **opp)
+	{
+		char_type	*pp = *opp;
+		char_type	*p;
+		long		 i;
+
+		/* The decompressor widens the codes after the last one as usual */
+		if (z->n_bits < z->maxbits && z->free_ent > MAXCODE(z->n_bits)-1)
+		{
+			pad_group(pp, z->bitbuf, z->bitcnt, z->ngroup, z->n_bits);
+			++z->n_bits;
+		}
+
+		output(pp,z->bitbuf,z->bitcnt,CLEAR,z->n_bits);
+		++z->ngroup;
+		pad_group(pp, z->bitbuf, z->bitcnt, z->ngroup, z->n_bits);
+		output(pp,z->bitbuf,z->bitcnt,CLEAR,INIT_BITS);
+		++z->ngroup;
+		pad_group(pp, z->bitbuf, z->bitcnt, z->ngroup, INIT_BITS);
+		z->codes += 2;
+		*opp = pp;
+
+		if (z->summed < z->bytes_in)
+			lzw_sum(z, &z->held, z->bytes_in-1, z->bytes_in);
+		z->seg[z->nseg-1].sum = z->sum;
+
+		z->ntail = z->nseg*EXT_SEGSIZ + EXT_FOOTSIZ;
+		if ((z->tail = malloc(z->ntail)) == NULL)
+			return LZW_ENOMEM;
+
+		for (i = 0, p = z->tail ; i < z->nseg ; ++i, p += EXT_SEGSIZ)
+		{
+			put_le(p, z->seg[i].coff, 8);
+			put_le(p+8, z->seg[i].uoff, 8);
+			put_le(p+16, z->seg[i].sum, 4);
+		}
+
+		put_le(p, z->nseg, 4);
+		put_le(p+4, z->bytes_in, 8);
+		put_le(p+12, adler32(1, z->tail, z->ntail - 8), 4);
+		memcpy(p+16, EXT_MAGIC, 4);
+		return LZW_OK;
+	}
+
+/*
+ * Decompressor: the trailer is complete; check it against what was
+ * decoded.
+ */
+int
+lzw_tail(struct lzw_stream *z, long usize)
+	{
+		const char_type	*p = z->tail;
+		const char_type	*foot = z->tail + z->ntail - EXT_FOOTSIZ;
+		long			 i;
+
+		if (get_le(foot, 4) != (uint64_t)z->nseg ||
+			(long)get_le(foot+4, 8) != usize ||
+			get_le(foot+12, 4) != adler32(1, z->tail, z->ntail - 8) ||
+			memcmp(foot+16, EXT_MAGIC, 4) != 0)
+			return LZW_ECORRUPT;
+
+		for (i = 0 ; i < z->nseg ; ++i, p += EXT_SEGSIZ)
+			if ((long)get_le(p+8, 8) != z->seg[i].uoff ||
+				get_le(p+16, 4) != z->seg[i].sum)
+				return LZW_ECORRUPT;
+
+		z->tailok = 1;
+		return LZW_OK;
+	}
+
+/*
+ * To be called at the end of the input: LZW_ECORRUPT if an extended file
+ * ended before its trailer did.
+ */
+int
+lzw_decode_end(struct lzw_stream *z)
+	{
+		return (z->ext && !z->tailok) ? LZW_ECORRUPT : LZW_OK;
+	}
+
+/*
+ * Adler-32 as in RFC 1950; start with adler = 1.
+ */
+uint32_t
+adler32(uint32_t adler, const char_type *p, size_t len)
+	{
+		uint32_t	a = adler & 0xffff;
+		uint32_t	b = adler >> 16;
+		size_t		n;
+
+		while (len > 0)
+		{
+			n = (len < 5552) ? len : 5552;	/* Largest n for which b cannot overflow */
+			len -= n;
+
+			while (n-- > 0)
+			{
+				a += *p++;
+				b += a;
+			}
+
+			a %= 65521;
+			b %= 65521;
+		}
+
+		return (b << 16) | a;
+	}
+
+void
+put_le(char_type *p, uint64_t v, int n)
+	{
+		while (n-- > 0)
+		{
+			*p++ = (char_type)v;
+			v >>= 8;
+		}
+	}
+
+uint64_t
+get_le(const char_type *p, int n)
+	{
+		uint64_t	v = 0;
+
+		while (n-- > 0)
+			v = (v << 8) | p[n];
+
+		return v;
+	}
+
+/*
+ * Set up the decompressor once the header is known.
+ */
+int
+lzw_decode_header(struct lzw_stream *z)
+	{
+		int code;
+
+		z->maxbits = z->hdr[2] & BIT_MASK;
+		z->block_mode = z->hdr[2] & BLOCK_MODE;
+
+		if (z->maxbits > z->bitlimit)
+			return LZW_EBITS;
+
+		if (z->hdrlen > 3)
+		{/* The trailer is checked against the data, so test mode decodes it all */
+			if (z->hdr[3] != EXT_INDEX || !z->block_mode)
+				return LZW_EFORMAT;
+
+			z->ext = 1;
+			z->test = 0;
+			z->sum = 1;
+			if (lzw_addseg(z, z->hdrlen, 0) != LZW_OK)
+				return LZW_ENOMEM;
+		}
+
+		if (lzw_alloc(z, DE_HTABSIZ(z->maxbits), 1L << z->maxbits) != LZW_OK)
+			return LZW_ENOMEM;
+
+		z->maxmaxcode = MAXCODE(z->maxbits);
+		reset_n_bits_for_decompressor(z->n_bits, z->maxbits, z->maxcode, z->maxmaxcode);
+		z->free_ent = ((z->block_mode) ? FIRST : 256);
+
+		clear_tab_prefixof(z);	/* As above, initialize the first
+								   256 entries in the table. */
+
+		for (code = 255 ; code >= 0 ; --code)
+			tab_suffixof(z, code) = (char_type)code;
+
+		if (z->test)
+			for (code = 255 ; code >= 0 ; --code)
+				tab_lengthof(z, code) = 1;
+
+		z->stackp = de_stack(z);
+		return LZW_OK;
+	}
+
+/*
+ * Move bytes that did not fit in the caller's buffer earlier.
+ */
+char_type *
+lzw_drain(struct lzw_stream *z, char_type *op, char_type *oend)
+	{
+		int i = z->npend;
+
+		if (i > oend-op)
+			i = (int)(oend-op);
+
+		if (i > 0)
+		{
+			memcpy(op, z->pend, i);
+			op += i;
+			z->npend -= i;
+			memmove(z->pend, z->pend+i, z->npend);
+		}
+
+		if (z->npend == 0 && z->tailpos < z->ntail)
+		{/* The trailer of the extended format */
+			i = (int)min(z->ntail - z->tailpos, oend-op);
+			memcpy(op, z->tail + z->tailpos, i);
+			op += i;
+			z->tailpos += i;
+		}
+
+		return op;
+	}
+
+/*
+ * The code of ent followed by c in the table of the compressor z, or -1.
+ */
+code_int
+lzw_lookup(struct lzw_stream *z, code_int ent, int c)
+	{
+		long			 fc = ((long)ent << 8) | c;
+		long			 hp = (((long)c) << z->hshift) ^ (long)ent;
+#ifndef FAST
+		long			 disp = (z->hsize - hp)-1;
+		code_int		 i;
+
+		while ((i = z->htab[hp]) != fc)
+		{
+			if (i == -1)
+				return -1;
+			if ((hp -= disp) < 0)
+				hp += z->hsize;
+		}
+#else
+		long			 i;
+
+		while ((i = z->htab[hp]) != fc)
+		{
+			if (i == -1)
+				return -1;
+			hp = (hp+primetab[c])&(z->hsize-1);
+		}
+#endif
+		return z->codetab[hp];
+	}
+
+/*
+ * How many bytes of p, up to end, extend the string of code ent.
+ */
+long
+lzw_match(struct lzw_stream *z, code_int ent, const char_type *p, const char_type *end)
+	{
+		const char_type	*q;
+
+		for (q = p ; q < end && (ent = lzw_lookup(z, ent, *q)) != -1 ; ++q)
+			;
+
+		return q - p;
+	}
+
+/*
+ * Flexible parsing (--best).  The phrase that starts with the byte ent goes
+ * on with p.  Greedy parsing takes the longest string in the table, but a
+ * shorter one can let the next phrase reach so much further that the two
+ * cover more input.  Try the greedy length and up to BEST_TRY below it,
+ * looking no further than end, and return the best length if it is shorter
+ * than the greedy one, else 0.  end is BEST_LOOK bytes after p unless the
+ * input ends before, so the choice does not depend on how it is read.  A shorter phrase costs the table the entry
+ * the greedy one adds, which is worth more the longer it is, so it must
+ * reach more than half the greedy length further.
+ *
+ * The output stays an ordinary code stream: after a shorter phrase the
+ * decompressor adds an entry the table already has, and the compressor
+ * only counts it in free_ent.
+ */
+long
+lzw_best(struct lzw_stream *z, code_int ent, const char_type *p, const char_type *end)
+	{
+		long			 len = 1 + lzw_match(z, ent, p, end);
+		long			 most;
+		long			 n;
+		long			 j;
+		long			 ret = 0;
+
+		if (len == 1 || p+len-1 >= end)		/* No choice, or cannot see its end */
+			return 0;
+
+		most = len + 1 + lzw_match(z, p[len-1], p+len, end);
+
+		for (j = len-1 ; j >= 1 && j >= len-BEST_TRY ; --j)
+		{
+			n = j + 1 + lzw_match(z, p[j-1], p+j, end);
+			if (n > most + 1 + len/2)
+			{
+				most = n;
+				ret = j;
+			}
+		}
+
+		return ret;
+	}
+
+/*
+ * compress
+ *
+ * Algorithm:  use open addressing double hashing (no chaining) on the
+ * prefix code / next character combination.  We do a variant of Knuth's
+ * algorithm D (vol. 3, sec. 6.4) along with G. Knott's relatively-prime
+ * secondary probe.  Here, the modular division first probe is gives way
+ * to a faster exclusive-or manipulation.  Also do block compression with
+ * an adaptive reset, whereby the code table is cleared when the compression
+ * ratio decreases, but after the table fills.  The variable-length output
+ * codes are re-sized at this point, and a special CLEAR code is generated
+ * for the decompressor.  Late addition:  construct the table according to
+ * file size for noticeable speed improvement on small files.  Please direct
+ * questions about this implementation to ames!jaw.
+ *
+ * lzw_encode_run() consumes input until it runs out or until a code has
+ * been written past olimit; the caller keeps ENC_SLACK bytes of room after
+ * olimit, which is enough for the largest burst one input byte can cause
+ * (a code, a CLEAR and the padding of a code group).  With --best it also
+ * stops where a phrase starts less than BEST_LOOK bytes before iend, unless
+ * that is the end of the input.
+ */
+void
+lzw_encode_run(struct lzw_stream *z, const char_type **ipp, const char_type *iend,
+				char_type **opp, char_type *olimit)
+	{
+		const char_type	*ip = *ipp;
+		char_type		*op = *opp;
+		count_int		*htab = z->htab;
+		codetab_int		*codetab = z->codetab;
+		uint64_t		 bitbuf = z->bitbuf;
+		int				 bitcnt = z->bitcnt;
+		int				 n_bits = z->n_bits;
+		int				 ngroup = z->ngroup;
+		int				 stcode = z->stcode;
+		code_int		 free_ent = z->free_ent;
+		code_int		 extcode = z->maxcode;
+		code_int		 ent = z->ent;
+		long			 bytes_in = z->bytes_in;
+		long			 codes = z->codes;
+		long			 cut = z->cut;
+#ifdef MEMOSIZE
+		long			 memo_hits = z->memo_hits;
+		uint64_t		*memo = z->memo;
+		uint64_t		*mp;
+#endif
+#ifdef FAST
+		long			 hmask = z->hsize-1;
+#else
+		long			 hsize = z->hsize;
+#endif
+		int				 hshift = z->hshift;
+		long			 hp;
+		long			 fc;
+		int				 c;
+
+		if (ent == -1 && ip < iend)
+		{
+			ent = *ip++;
+			bytes_in++;
+		}
+
+		while (ip < iend)
+		{
+			if (ent < FIRST && (free_ent >= extcode || (!stcode && bytes_in >= z->checkpoint) ||
+								bytes_in >= z->nextseg))
+			{
+				int clear = (bytes_in >= z->nextseg);
+
+				if (free_ent >= extcode)
+				{
+					if (n_bits < z->maxbits)
+					{
+						pad_group(op, bitbuf, bitcnt, ngroup, n_bits);
+						if (++n_bits < z->maxbits)
+							extcode = MAXCODE(n_bits)+1;
+						else
+							extcode = MAXCODE(n_bits);
+						PROBE3(compress__width, n_bits, bytes_in, z->bytes_out + (op - *opp));
+					}
+					else
+					{
+						extcode = MAXCODE(MAXBITS)+OBUFSIZ;
+						stcode = 0;
+					}
+				}
+
+				if (!stcode && bytes_in >= z->checkpoint)
+				{
+					long int rat;
+					long int out = z->bytes_out + (op - *opp);
+
+					z->checkpoint = bytes_in + CHECK_GAP;
+
+					if (bytes_in > 0x007fffff)
+					{							/* shift will overflow */
+						rat = out >> 8;
+
+						if (rat == 0)				/* Don't divide by zero */
+							rat = 0x7fffffff;
+						else
+							rat = bytes_in / rat;
+					}
+					else
+						rat = (bytes_in << 8) / out;	/* 8 fractional bits */
+					if (rat >= z->ratio)
+						z->ratio = (int)rat;
+					else
+						clear = 1;
+				}
+
+				if (clear)
+				{
+					z->ratio = 0;
+					clear_htab(z);
+#ifdef MEMOSIZE
+					memset(memo, 0, sizeof(z->memo));
+#endif
+					output(op,bitbuf,bitcnt,CLEAR,n_bits);
+					++ngroup;
+					++codes;
+					pad_group(op, bitbuf, bitcnt, ngroup, n_bits);
+					reset_n_bits_for_compressor(n_bits, stcode, free_ent, extcode, z->maxbits);
+					z->clear_in = bytes_in-1;		/* ent is coded after it */
+					z->clear_out = z->bytes_out + (op - *opp);
+					PROBE2(compress__clear, z->clear_in, z->clear_out);
+
+					if (z->ext)
+					{/* A segment starts with ent, the byte last read */
+						z->seg[z->nseg].coff = z->bytes_out + (op - *opp);
+						z->seg[z->nseg].uoff = bytes_in-1;
+						z->seg[z->nseg].sum = 0;
+						++z->nseg;
+						z->nextseg = bytes_in-1 + SEGSIZE;
+					}
+				}
+
+				if (op > olimit)
+					break;
+			}
+
+			if (z->best && ent < FIRST)
+			{/* A phrase starts */
+				long len;
+
+				if (iend - ip < BEST_LOOK && !z->lookend)
+					break;			/* Wait for the rest of the lookahead */
+
+				len = lzw_best(z, ent, ip, (iend - ip > BEST_LOOK) ? ip + BEST_LOOK : iend);
+				cut = (len > 0) ? bytes_in + len : 0;
+			}
+
+			c = *ip++;
+			bytes_in++;
+			fc = ((long)ent << 8) | c;
+
+			if (bytes_in == cut)
+			{/* --best ends the phrase here; ent followed by c is known */
+				output(op,bitbuf,bitcnt,ent,n_bits);
+				++ngroup;
+				++codes;
+				ent = c;
+				if (stcode)
+					free_ent++;
+
+				if (op > olimit)
+					break;
+
+				continue;
+			}
+
+#ifdef MEMOSIZE
+			/*
+			 * The successor cache remembers for every code (modulo MEMOSIZE)
+			 * the character that last followed it and the resulting code,
+			 * so that the chains of repetitive input are followed in a
+			 * table that stays in the L1 cache.  An entry holds fc+1 (0 is
+			 * free) above the code; codes never change until a CLEAR.
+			 */
+			mp = &memo[ent & (MEMOSIZE-1)];
+			if ((*mp >> 32) == (uint64_t)fc+1)
+			{
+				ent = (code_int)(*mp & 0xffffffff);
+				++memo_hits;
+				continue;
+			}
+#endif
+#ifndef FAST
+			{
+				code_int i;
+				hp = (((long)c) << hshift) ^ (long)ent;
+
+				if ((i = htab[hp]) == fc)
+					goto hfound;
+
+				if (i != -1)
+				{
+					long disp;
+
+					disp = (hsize - hp)-1;	/* secondary hash (after G. Knott) */
+
+					do
+					{
+						if ((hp -= disp) < 0)	hp += hsize;
+
+						if ((i = htab[hp]) == fc)
+							goto hfound;
+					}
+					while (i != -1);
+				}
+			}
+#else
+			{
+				long i;
+				long p;
+				hp = ((((long)c) << hshift) ^ (long)ent);
+
+				if ((i = htab[hp]) == fc)	goto hfound;
+				if (i == -1)				goto out;
+
+				p = primetab[c];
+lookup:			hp = (hp+p)&hmask;
+				if ((i = htab[hp]) == fc)	goto hfound;
+				if (i == -1)				goto out;
+				hp = (hp+p)&hmask;
+				if ((i = htab[hp]) == fc)	goto hfound;
+				if (i == -1)				goto out;
+				hp = (hp+p)&hmask;
+				if ((i = htab[hp]) == fc)	goto hfound;
+				if (i == -1)				goto out;
+				goto lookup;
+			}
+out:		;
+#endif
+			output(op,bitbuf,bitcnt,ent,n_bits);
+			++ngroup;
+			++codes;
+			ent = c;
+
+			if (stcode)
+			{
+#ifdef MEMOSIZE
+				*mp = (((uint64_t)fc+1) << 32) | free_ent;
+#endif
+				codetab[hp] = (codetab_int)free_ent++;
+				htab[hp] = fc;
+			}
+
+			if (op > olimit)
+				break;
+
+			continue;
+hfound:		ent = codetab[hp];
+#ifdef MEMOSIZE
+			*mp = (((uint64_t)fc+1) << 32) | ent;
+#endif
+		}
+
+		z->bytes_out += op - *opp;
+		*ipp = ip;
+		*opp = op;
+		z->bitbuf = bitbuf;
+		z->bitcnt = bitcnt;
+		z->n_bits = n_bits;
+		z->ngroup = ngroup & 7;
+		z->stcode = stcode;
+		z->free_ent = free_ent;
+		z->maxcode = extcode;
+		z->ent = ent;
+		z->bytes_in = bytes_in;
+		z->codes = codes;
+		z->cut = cut;
+#ifdef MEMOSIZE
+		z->memo_hits = memo_hits;
+#endif
+	}
+
+/*
+ * Compress up to *inlen bytes from in into at most *outlen bytes at out.
+ * Once all input has been given, keep calling with finish set (and no
+ * input) until LZW_END is returned.  With --best the input goes through
+ * z->look, where the end of it waits for the bytes that follow.
+ */
+int
+lzw_encode(struct lzw_stream *z, const char_type *in, size_t *inlen,
+			char_type *out, size_t *outlen, int finish)
+	{
+		const char_type	*ip = in;
+		const char_type	*iend = in + *inlen;
+		const char_type	*rp;
+		const char_type	*rend;
+		const char_type	*rstart;
+		char_type		*op = out;
+		char_type		*oend = out + *outlen;
+		long			 from;
+		long			 n;
+
+		if (z->nhdr < z->hdrlen)
+		{
+			memcpy(z->pend+z->npend, z->hdr, z->hdrlen);
+			z->npend += z->hdrlen;
+			z->nhdr = z->hdrlen;
+			z->bytes_out = z->hdrlen;
+		}
+
+		/* Room for the segments of every CLEAR this input can cause */
+		n = (long)*inlen + z->nlook;
+		if (z->ext && lzw_segroom(z, n / CHECK_GAP + n / SEGSIZE + 3) != LZW_OK)
+			return LZW_ENOMEM;
+
+		for (;;)
+		{
+			op = lzw_drain(z, op, oend);
+
+			if (z->npend > 0)
+				break;
+
+			if (z->best)
+			{
+				n = min(iend - ip, (long)sizeof(z->look) - z->nlook);
+				memcpy(z->look + z->nlook, ip, n);
+				ip += n;
+				z->nlook += n;
+				z->lookend = (finish && ip >= iend);
+				rp = z->look;
+				rend = z->look + z->nlook;
+			}
+			else
+			{
+				rp = ip;
+				rend = iend;
+			}
+
+			if (rp >= rend)
+				break;
+
+			rstart = rp;
+			from = z->bytes_in;
+
+			if (oend-op > ENC_SLACK)
+				lzw_encode_run(z, &rp, rend, &op, oend-ENC_SLACK);
+			else
+			{
+				char_type *pp = z->pend;
+
+				lzw_encode_run(z, &rp, rend, &pp, z->pend);
+				z->npend = (int)(pp - z->pend);
+			}
+
+			if (z->ext && rp > rstart)
+			{/* The sums lag one byte behind: a CLEAR may still end a segment
+			  * before the byte last read */
+				if (z->summed < from)
+					lzw_sum(z, &z->held, from-1, from);
+				lzw_sum(z, rstart, from, z->bytes_in-1);
+				z->held = rp[-1];
+			}
+
+			if (z->best)
+			{
+				z->nlook = rend - rp;
+				memmove(z->look, rp, z->nlook);
+				if (rp == rstart)
+					break;		/* Waits for more input */
+			}
+			else
+				ip = rp;
+		}
+
+		if (finish && ip >= iend && z->npend == 0 && z->nlook == 0 && !z->finished)
+		{
+			char_type *pp = z->pend;
+
+			if (z->ent != -1)
+			{
+				output(pp,z->bitbuf,z->bitcnt,z->ent,z->n_bits);
+				z->ent = -1;
+				++z->ngroup;
+				++z->codes;
+			}
+
+			if (z->ext && lzw_finish_ext(z, &pp) != LZW_OK)
+				return LZW_ENOMEM;
+
+			if (z->bitcnt > 0)
+				*pp++ = (char_type)z->bitbuf;
+
+			z->bitbuf = 0;
+			z->bitcnt = 0;
+			z->npend = (int)(pp - z->pend);
+			z->bytes_out += z->npend + z->ntail;
+			z->finished = 1;
+
+			op = lzw_drain(z, op, oend);
+		}
+
+		*inlen = ip - in;
+		*outlen = op - out;
+
+		return (z->finished && z->npend == 0 && z->tailpos == z->ntail) ? LZW_END : LZW_OK;
+	}
+
+/*
+ * Decompress.  This routine adapts to the codes in the file building the
+ * "string" table on-the-fly; requiring no table to be stored in the
+ * compressed file.
+ *
+ * A string longer than the room left in the output buffer stays on the
+ * stack and is written out by the next call.
+ */
+int
+lzw_decode(struct lzw_stream *z, const char_type *in, size_t *inlen,
+			char_type *out, size_t *outlen)
+	{
+		const char_type	*ip = in;
+		const char_type	*iend = in + *inlen;
+		char_type		*op = out;
+		char_type		*oend = out + *outlen;
+		char_type		*stackp;
+		uint64_t		 bitbuf;
+		int				 bitcnt;
+		int				 n_bits;
+		int				 bitmask;
+		int				 ngroup;
+		int				 finchar;
+		code_int		 code;
+		code_int		 incode;
+		code_int		 oldcode;
+		code_int		 free_ent;
+		code_int		 maxcode;
+		code_int		 maxmaxcode;
+		int				 block_mode;
+		int				 skip;
+		codetab_int		*prefix;
+		char_type		*suffix;
+		char_type		*stack;
+		codetab_int		*length;
+		char_type		*first;
+		char_type		*mark = out;
+		int				 test;
+		int				 ext;
+		long			 tested = 0;
+		long			 codes;
+		int				 ret = LZW_OK;
+
+		while (z->nhdr < z->hdrlen)
+		{
+			if (ip >= iend)
+				goto hdrout;
+
+			z->hdr[z->nhdr++] = *ip++;
+
+			if ((z->nhdr >= 1 && z->hdr[0] != MAGIC_1) ||
+				(z->nhdr >= 2 && z->hdr[1] != MAGIC_2))
+			{
+				ret = LZW_EMAGIC;
+				goto hdrout;
+			}
+
+			if (z->nhdr == 3 && (z->hdr[2] & EXT_MODE))
+				z->hdrlen = 4;
+
+			if (z->nhdr == z->hdrlen && (ret = lzw_decode_header(z)) != LZW_OK)
+				goto hdrout;
+		}
+
+		prefix = &tab_prefixof(z, 0);
+		suffix = &tab_suffixof(z, 0);
+		stack = de_stack(z);
+		length = &tab_lengthof(z, 0);
+		first = &tab_firstof(z, 0);
+		block_mode = z->block_mode;
+		maxmaxcode = z->maxmaxcode;
+		stackp = z->stackp;
+		bitbuf = z->bitbuf;
+		bitcnt = z->bitcnt;
+		n_bits = z->n_bits;
+		bitmask = (1<<n_bits)-1;
+		ngroup = z->ngroup;
+		skip = z->skip;
+		finchar = z->finchar;
+		oldcode = z->oldcode;
+		free_ent = z->free_ent;
+		maxcode = z->maxcode;
+		codes = z->codes;
+		test = z->test;
+		ext = z->ext;
+
+		if (z->intail)
+			goto trailer;
+
+		for (;;)
+		{
+			if (stackp < stack || free_ent > maxcode || skip > 0)
+			{
+				/* Put out what did not fit of the last string */
+
+				if (stackp < stack)
+				{
+					int i = (int)(stack-stackp);
+
+					if (i > oend-op)
+						i = (int)(oend-op);
+
+					memcpy(op, stackp, i);
+					op += i;
+					stackp += i;
+
+					if (stackp < stack)
+						break;
+				}
+
+				if (free_ent > maxcode)
+				{
+					skip += group_padding(ngroup, n_bits);
+					ngroup = 0;
+
+					++n_bits;
+					if (n_bits == z->maxbits)
+						maxcode = z->maxmaxcode;
+					else
+					    maxcode = MAXCODE(n_bits)-1;
+
+					bitmask = (1<<n_bits)-1;
+					PROBE3(uncompress__width, n_bits, z->bytes_in + (ip-in), z->bytes_out + (op-out));
+				}
+
+				while (skip > 0)
+				{
+					int i;
+
+					if (bitcnt == 0)
+					{
+						bitbuf = 0;
+
+						if (skip >= 8 && ip < iend)
+						{
+							i = skip >> 3;
+							if (i > iend-ip)
+								i = (int)(iend-ip);
+							ip += i;
+							skip -= i<<3;
+							continue;
+						}
+
+						if (ip >= iend)
+							goto out;
+
+						bitbuf = *ip++;
+						bitcnt = 8;
+					}
+
+					i = min(skip, bitcnt);
+					bitbuf >>= i;
+					bitcnt -= i;
+					skip -= i;
+				}
+			}
+
+			if (bitcnt < n_bits)
+			{
+				if (iend-ip >= 8)
+				{
+					bitbuf |= load_bits(ip) << bitcnt;
+					ip += (63-bitcnt)>>3;
+					bitcnt |= 56;
+				}
+				else
+				{
+					do
+					{
+						if (ip >= iend)
+							goto out;
+
+						bitbuf |= ((uint64_t)*ip++) << bitcnt;
+						bitcnt += 8;
+					}
+					while (bitcnt < n_bits);
+				}
+			}
+
+			code = bitbuf & bitmask;
+			bitbuf >>= n_bits;
+			bitcnt -= n_bits;
+			ngroup = (ngroup+1)&7;
+			++codes;
+
+			if (oldcode == -1 && !(code == CLEAR && ext))
+			{
+				if (code >= 256)
+				{
+					ret = LZW_ECORRUPT;
+					goto out;
+				}
+
+				finchar = (int)(oldcode = code);
+
+				if (test)
+					++tested;
+				else
+					*--stackp = (char_type)finchar;
+
+				continue;
+			}
+
+			if (code == CLEAR && block_mode)
+			{
+				if (ext && free_ent == FIRST - 1)
+				{/* Two CLEARs in a row: the codes are over */
+					skip += group_padding(ngroup, n_bits);
+					ngroup = 0;
+					--z->nseg;
+					z->intail = 1;
+					z->ntail = z->nseg*EXT_SEGSIZ + EXT_FOOTSIZ;
+					if ((z->tail = malloc(z->ntail)) == NULL)
+					{
+						ret = LZW_ENOMEM;
+						goto out;
+					}
+
+					goto trailer;
+				}
+
+				if (!test)
+					clear_tab_prefixof(z);
+    			free_ent = FIRST - 1;
+				z->clear_at = 8*(z->bytes_in + (ip-in)) - bitcnt - n_bits;
+				skip += group_padding(ngroup, n_bits);
+				ngroup = 0;
+				reset_n_bits_for_decompressor(n_bits, z->maxbits, maxcode, z->maxmaxcode);
+				bitmask = (1<<n_bits)-1;
+				z->clear_in = (8*(z->bytes_in + (ip-in)) - bitcnt + skip) >> 3;
+				z->clear_out = z->bytes_out + (op-out) + tested + (stack-stackp);
+				PROBE2(uncompress__clear, z->clear_in, z->clear_out);
+
+				if (ext)
+				{/* Each CLEAR starts a segment */
+					z->sum = adler32(z->sum, mark, op - mark);
+					mark = op;
+					z->seg[z->nseg-1].sum = z->sum;
+					z->sum = 1;
+					if (lzw_addseg(z, 0, z->bytes_out + (op - out)) != LZW_OK)
+					{
+						ret = LZW_ENOMEM;
+						goto out;
+					}
+				}
+
+				if (z->stopclear)
+					goto out;
+
+				continue;
+			}
+
+			if (test)
+			{/* Only follow the lengths and first characters of the strings */
+				int	c;
+
+				if (code >= free_ent)
+				{
+					if (code > free_ent)
+					{
+						ret = LZW_ECORRUPT;
+						goto out;
+					}
+
+					tested += length[oldcode] + 1;
+					c = finchar;
+				}
+				else
+				{
+					tested += length[code];
+					c = first[code];
+				}
+
+				if (free_ent < maxmaxcode)
+				{
+					length[free_ent] = length[oldcode] + 1;
+					first[free_ent] = (char_type)finchar;
+					++free_ent;
+				}
+
+				finchar = c;
+				oldcode = code;
+				continue;
+			}
+
+			incode = code;
+
+			if (code >= free_ent)	/* Special case for KwKwK string.	*/
+			{
+				if (code > free_ent)
+				{
+					ret = LZW_ECORRUPT;
+					goto out;
+				}
+
+       	    	*--stackp = (char_type)finchar;
+	    		code = oldcode;
+			}
+
+			while ((cmp_code_int)code >= (cmp_code_int)256)
+			{ /* Generate output characters in reverse order */
+		    	*--stackp = suffix[code];
+		    	code = prefix[code];
+			}
+
+			*--stackp =	(char_type)(finchar = suffix[code]);
+
+			if ((code = free_ent) < maxmaxcode) /* Generate the new entry. */
+			{
+		    	prefix[code] = (codetab_int)oldcode;
+		    	suffix[code] = (char_type)finchar;
+    			free_ent = code+1;
+			}
+
+			oldcode = incode;	/* Remember previous code.	*/
+
+			/* And put them out in forward order */
+
+			if (stack-stackp <= oend-op)
+			{
+				int i = (int)(stack-stackp);
+
+				memcpy(op, stackp, i);
+				op += i;
+				stackp += i;
+			}
+		}
+
+		goto out;
+
+trailer:
+		/* Whole bytes are left once the padding after the codes is gone */
+		while (skip > 0)
+		{
+			int i;
+
+			if (bitcnt == 0)
+			{
+				i = (int)min(skip >> 3, iend-ip);
+				ip += i;
+				skip -= i<<3;
+				if (skip > 0)
+					goto out;
+				break;
+			}
+
+			i = min(skip, bitcnt);
+			bitbuf >>= i;
+			bitcnt -= i;
+			skip -= i;
+		}
+
+		while (bitcnt >= 8 && z->tailpos < z->ntail)
+		{
+			z->tail[z->tailpos++] = (char_type)bitbuf;
+			bitbuf >>= 8;
+			bitcnt -= 8;
+		}
+
+		if (z->tailpos < z->ntail)
+		{
+			long i = min(z->ntail - z->tailpos, iend-ip);
+
+			memcpy(z->tail + z->tailpos, ip, i);
+			z->tailpos += i;
+			ip += i;
+		}
+
+		if (z->tailpos == z->ntail)
+		{
+			if (bitcnt > 0 || ip < iend)
+				ret = LZW_ECORRUPT;
+			else if (!z->tailok)
+				ret = lzw_tail(z, z->bytes_out + (op - out));
+		}
+
+out:	if (ext)
+			z->sum = adler32(z->sum, mark, op - mark);
+
+		z->stackp = stackp;
+		z->bitbuf = bitbuf & ((((uint64_t)1)<<bitcnt)-1);
+		z->bitcnt = bitcnt;
+		z->n_bits = n_bits;
+		z->ngroup = ngroup;
+		z->skip = skip;
+		z->finchar = finchar;
+		z->oldcode = oldcode;
+		z->free_ent = free_ent;
+		z->maxcode = maxcode;
+		z->codes = codes;
+
+hdrout:	*inlen = ip - in;
+		*outlen = op - out;
+		z->bytes_in += *inlen;
+		z->bytes_out += *outlen + tested;
+
+		return ret;
+	}
+
+/*
+ * Compress NPROBES pieces of PROBESIZ bytes spread over the file, each with
+ * a fresh table, and return the total input and output in *pin and *pout.
+ * The file offset is put back at the start.  Returns 0 if the file is too
+ * small to be worth sampling or cannot be read that way.
+ */
+int
+sample(int fd, long *pin, long *pout)
+	{
+		off_t			 size = infstat.st_size;
+		size_t			 ilen;
+		size_t			 olen;
+		long			 left;
+		int				 rsize;
+		int				 i;
+		int				 ok = 0;
+		const char_type	*ip;
+
+		*pin = *pout = 0;
+
+		if (size < 2 * NPROBES * PROBESIZ)
+			return 0;
+
+		for (i = 0 ; i < NPROBES ; ++i)
+		{
+			if (lseek(fd, (size - PROBESIZ) / (NPROBES - 1) * i, SEEK_SET) == -1 ||
+				lzw_init(&engine, 1, maxbits) != LZW_OK)
+				goto out;
+
+			for (left = PROBESIZ ; left > 0 ; left -= rsize)
+			{
+				if ((rsize = read(fd, inbuf, min(left, IBUFSIZ))) <= 0)
+					goto out;
+
+				ip = inbuf;
+				ilen = rsize;
+
+				do
+				{
+					olen = OBUFSIZ;
+					lzw_encode(&engine, ip, &ilen, outbuf, &olen, 0);
+					ip += ilen;
+					ilen = inbuf + rsize - ip;
+				}
+				while (ilen > 0);
+			}
+
+			do
+			{
+				ilen = 0;
+				olen = OBUFSIZ;
+			}
+			while (lzw_encode(&engine, inbuf, &ilen, outbuf, &olen, 1) != LZW_END);
+
+			*pin += engine.bytes_in;
+			*pout += engine.bytes_out - 3;
+		}
+
+		ok = 1;
+
+out:
+		if (lseek(fd, 0, SEEK_SET) != 0)
+			read_error();
+
+		return ok;
+	}
+
+/*
+ * -b auto: compress about the first AUTO_PREFIX bytes of the input with
+ * every code width up to maxbits, up to jobs of them at once on threads,
+ * each with its own stream; the first thread uses the engine.  With -M
+ * only as many run at once as their tables fit in memlimit together.  The
+ * trials keep nothing but the size of their output, and the tables of the
+ * other threads are freed once they are done.  The engine then compresses
+ * the start again with the width whose output is smallest, the widest of
+ * equals, and carries on with the rest of the input, so the file comes out
+ * just as with -b and that width.
+ */
+void
+bits_pick(int fdin, int fdout, struct cache_hint *hin, struct cache_hint *hout)
+	{
+		struct bits_job	 job[MAXBITS+1];
+		const char_type	*ip;
+		size_t			 ilen;
+		size_t			 olen;
+		long			 len = 0;
+		long			 mem;
+		int				 rsize = 0;
+		int				 bits = 0;
+		int				 n = 1;
+		int				 i;
+#ifdef PTHREADS
+		pthread_t		 thread[MAXBITS+1];
+		int				 nt;
+#endif
+
+		if (bits_buf == NULL && (bits_buf = malloc(AUTO_PREFIX + IBUFSIZ)) == NULL)
+		{
+			fprintf(stderr, "Cannot allocate memory for compression tables.\n");
+			abort_compress();
+		}
+
+		while (len < AUTO_PREFIX && (rsize = read(fdin, bits_buf + len, IBUFSIZ)) > 0)
+		{
+			len += rsize;
+			rate_wait(rsize);
+			hint_io(hin, rsize);
+			PROBE2(read, fdin, rsize);
+		}
+
+		if (rsize < 0)
+			read_error();
+
+		PROF(PROF_COMPUTE);
+#ifdef PTHREADS
+		if (jobs > 1)
+			n = min(jobs, maxbits - INIT_BITS + 1);
+#endif
+
+		if (memlimit > 0)
+		{/* Thread i starts with the widest of its widths, maxbits-i */
+			mem = lzw_memory(1, maxbits);
+			for (i = 1 ; i < n && (mem += lzw_memory(1, maxbits - i)) <= memlimit ; ++i)
+				;
+			n = i;
+		}
+
+		for (i = 0 ; i < n ; ++i)
+		{
+			job[i].z = (i == 0) ? &engine : &bits_z[i];
+			job[i].buf = bits_buf;
+			job[i].len = len;
+			job[i].first = maxbits - i;
+			job[i].step = n;
+		}
+
+#ifdef PTHREADS
+		for (nt = 1 ; nt < n ; ++nt)
+			if (pthread_create(&thread[nt-1], NULL, bits_worker, &job[nt]) != 0)
+				break;
+
+		for (i = nt ; i < n ; ++i)
+			bits_worker(&job[i]);	/* No thread for these */
+#endif
+		bits_worker(&job[0]);
+#ifdef PTHREADS
+		for (i = 1 ; i < nt ; ++i)
+			pthread_join(thread[i-1], NULL);
+#endif
+
+		for (i = 1 ; i < n ; ++i)
+			lzw_free(job[i].z);
+
+		for (i = maxbits ; i >= INIT_BITS ; --i)
+			if (btry[i].ret == LZW_OK && (bits == 0 || btry[i].size < btry[bits].size))
+				bits = i;
+
+		if (bits == 0 || lzw_init(&engine, 1, bits) != LZW_OK ||
+			(index_flg && lzw_extend(&engine) != LZW_OK))
+		{
+			fprintf(stderr, "Cannot allocate memory for compression tables.\n");
+			abort_compress();
+		}
+
+		engine.best = best_flg;
+
+		for (ip = bits_buf ; ip < bits_buf + len ; ip += ilen)
+		{
+			ilen = bits_buf + len - ip;
+			olen = OBUFSIZ;
+			PROF(PROF_COMPUTE);
+			lzw_encode(&engine, ip, &ilen, outbuf, &olen, 0);
+			PROF(PROF_IO);
+
+			if (olen > 0 && write(fdout, outbuf, olen) != (ssize_t)olen)
+				write_error();
+			rate_wait((long)olen);
+			hint_io(hout, (long)olen);
+			PROBE2(write, fdout, olen);
+
+			if (engine.clear_out <= engine.bytes_out - engine.npend)
+				resume_point(engine.clear_in, engine.clear_out, engine.maxbits);
+		}
+	}
+
+/*
+ * Try the code widths first, first-step, ... down to INIT_BITS.
+ */
+void *
+bits_worker(void *arg)
+	{
+		struct bits_job	*j = arg;
+		int				 bits;
+
+		for (bits = j->first ; bits >= INIT_BITS ; bits -= j->step)
+			bits_one(&btry[bits], j->z, bits, j->buf, j->len);
+
+		return NULL;
+	}
+
+/*
+ * Compress len bytes at buf with stream z, reset to the given width, and
+ * count the output, including what is still pending.
+ */
+void
+bits_one(struct bits_try *t, struct lzw_stream *z, int bits, const char_type *buf, long len)
+	{
+		const char_type	*ip = buf;
+		size_t			 ilen;
+		size_t			 olen;
+		char_type		 out[BUFSIZ];
+
+		t->size = 0;
+		if ((t->ret = lzw_init(z, 1, bits)) != LZW_OK ||
+			(index_flg && (t->ret = lzw_extend(z)) != LZW_OK))
+			return;
+
+		z->best = best_flg;
+
+		while (ip < buf + len)
+		{
+			ilen = buf + len - ip;
+			olen = sizeof(out);
+			if ((t->ret = lzw_encode(z, ip, &ilen, out, &olen, 0)) != LZW_OK)
+				return;
+			ip += ilen;
+			t->size += (long)olen;
+		}
+
+		t->size += z->npend;
+	}
+
+/*
+ * compress fdin to fdout
+ */
+void
+compress(int fdin, int fdout)
+	{
+		int				 rsize;
+		int				 ret;
+		size_t			 ilen;
+		size_t			 olen;
+		const char_type	*ip;
+		struct cache_hint hin;
+		struct cache_hint hout;
+#ifdef DAEMON
+		struct daemon_rep rep;
+
+		if (client_path != NULL && !index_flg && !best_flg && !auto_flg && resume_path == NULL &&
+			daemon_call(DOP_COMPRESS, maxbits, fdin, fdout, &rep) == 0)
+		{
+			if (rep.ret == LZW_ENOMEM)
+			{
+				fprintf(stderr, "Cannot allocate memory for compression tables.\n");
+				abort_compress();
+			}
+
+			bytes_in = rep.bytes_in;
+			bytes_out = rep.bytes_out;
+			cutoff_at = 0;
+			return;
+		}
+#endif
+
+		PROF(PROF_SETUP);
+
+		if (lzw_init(&engine, 1, maxbits) != LZW_OK ||
+			(index_flg && lzw_extend(&engine) != LZW_OK))
+		{
+			fprintf(stderr, "Cannot allocate memory for compression tables.\n");
+			abort_compress();
+		}
+
+		engine.best = best_flg;
+		bytes_out = 0; bytes_in = 0;
+		cutoff_at = 0;
+		if (resume_in >= 0)
+			resume_seek(&engine, fdin, fdout);
+		hint_start(&hin, fdin, 0);
+		hint_start(&hout, fdout, 1);
+		if (auto_flg && engine.bytes_in == 0)
+			bits_pick(fdin, fdout, &hin, &hout);
+
+		PROF(PROF_IO);
+
+		while ((rsize = read(fdin, inbuf, IBUFSIZ)) > 0)
+		{
+			ip = inbuf;
+			rate_wait(rsize);
+			hint_io(&hin, rsize);
+			PROBE2(read, fdin, rsize);
+
+			do
+			{
+				ilen = rsize;
+				olen = OBUFSIZ;
+				PROF(PROF_COMPUTE);
+				lzw_encode(&engine, ip, &ilen, outbuf, &olen, 0);
+				PROF(PROF_IO);
+
+				if (olen > 0 && write(fdout, outbuf, olen) != (ssize_t)olen)
+					write_error();
+				rate_wait((long)olen);
+				hint_io(&hout, (long)olen);
+				PROBE2(write, fdout, olen);
+
+				if (engine.clear_out <= engine.bytes_out - engine.npend)
+					resume_point(engine.clear_in, engine.clear_out, engine.maxbits);
+
+				ip += ilen;
+				rsize -= (int)ilen;
+			}
+			while (rsize > 0);
+
+			/*
+			 * The output file is removed anyway when it ends up larger than
+			 * the input, so once it is clearly heading there stop paying for
+			 * the rest of the input.
+			 */
+			if (cutoff_flg && remove_ofname && !force &&
+				engine.bytes_in >= CUTOFF_MIN &&
+				engine.bytes_out - engine.bytes_in > engine.bytes_in / 8)
+			{
+				bytes_in = cutoff_at = engine.bytes_in;
+				bytes_out = engine.bytes_out;
+				hint_end(&hin);
+				hint_end(&hout);
+				prof_end(&engine);
+				return;
+			}
+		}
+
+		if (rsize < 0)
+			read_error();
+
+		do
+		{
+			ilen = 0;
+			olen = OBUFSIZ;
+			PROF(PROF_COMPUTE);
+			ret = lzw_encode(&engine, inbuf, &ilen, outbuf, &olen, 1);
+			PROF(PROF_IO);
+
+			if (olen > 0 && write(fdout, outbuf, olen) != (ssize_t)olen)
+				write_error();
+			rate_wait((long)olen);
+			hint_io(&hout, (long)olen);
+			PROBE2(write, fdout, olen);
+		}
+		while (ret != LZW_END);
+
+		hint_end(&hin);
+		hint_end(&hout);
+		bytes_in = engine.bytes_in;
+		bytes_out = engine.bytes_out;
+#ifdef MEMOSIZE
+		memo_hits = engine.memo_hits;
+#endif
+		prof_end(&engine);
+	}
+
+/*
+ * Decompress fdin to fdout.
+ */
+void
+decompress(int fdin, int fdout)
+	{
+		struct lzw_stream	*z = NULL;
+		int					 rsize = 0;
+		int					 ret = LZW_OK;
+		size_t				 ilen;
+		size_t				 olen;
+		const char_type		*ip = inbuf;
+		char_type			*obuf = outbuf;
+		size_t				 osize = OBUFSIZ;
+		size_t				 ofill = 0;
+		int					 full;
+		int					 sized = 0;
+		int					 filebits;
+		struct lzw_index	 ix;
+		int					 indexed = 0;
+		struct cache_hint	 hin;
+		struct cache_hint	 hout;
+#ifdef DAEMON
+		struct daemon_rep	 rep;
+
+		if (client_path != NULL && resume_path == NULL &&
+			daemon_call(test_flg ? DOP_TEST : DOP_DECOMPRESS, maxdbits,
+						fdin, fdout, &rep) == 0)
+		{
+			bytes_in = rep.bytes_in;
+			bytes_out = rep.bytes_out;
+			filebits = rep.maxbits;
+			ret = rep.ret;
+			goto report;
+		}
+#endif
+
+		PROF(PROF_IO);
+
+		if (list_flg || (remove_ofname && !test_flg))
+			indexed = read_index(fdin, &ix);
+
+		if (list_flg && indexed)
+		{/* The sizes are in the index */
+			bytes_in = ix.tstart + ix.nseg*EXT_SEGSIZ + EXT_FOOTSIZ;
+			bytes_out = ix.usize;
+			free(ix.seg);
+			goto report;
+		}
+
+#ifdef PTHREADS
+		z = prefetch_take(fdin, fdout, &ret);
+#endif
+
+		if (z == NULL)
+		{
+			PROF(PROF_SETUP);
+			z = &engine;
+			if (lzw_init(z, 0, maxdbits) != LZW_OK)
+			{
+				fprintf(stderr, "Cannot allocate memory for decompression tables.\n");
+				abort_compress();
+			}
+
+			z->test = test_flg;
+		}
+
+		bytes_in = 0;
+		bytes_out = 0;
+
+		PROF(PROF_IO);
+
+		if (remove_ofname && !test_flg)
+		{/* A file of our own: reserve it and fill it in big writes */
+			if (sparse_flg)
+				sized = 1;		/* Blocks written would defeat the holes */
+			else
+				sized = prealloc(fdin, fdout, indexed ? ix.usize : -1);
+
+#ifdef PTHREADS
+			if (indexed && jobs > 1 && !sparse_flg && ix.nseg > 1 && rate_limit == 0 && !nocache_flg)
+			{/* Every thread uncompresses whole segments in place */
+				PROF(PROF_COMPUTE);
+				ret = segment_decode(fdin, fdout, &ix);
+				PROF(PROF_IO);
+
+				bytes_in = ix.tstart + ix.nseg*EXT_SEGSIZ + EXT_FOOTSIZ;
+				bytes_out = ix.usize;
+				filebits = ix.maxbits;
+				free(ix.seg);
+
+				if (ret == LZW_EREAD)
+					read_error();
+				if (ret == LZW_EWRITE)
+					write_error();
+				goto report;
+			}
+#endif
+
+			if (bigobuf != NULL || (bigobuf = malloc(BIGOBUFSIZ)) != NULL)
+			{
+				obuf = bigobuf;
+				osize = BIGOBUFSIZ;
+			}
+		}
+
+		if (indexed)
+			free(ix.seg);
+
+		if (resume_in >= 0)
+			resume_seek(z, fdin, fdout);
+		hint_start(&hin, fdin, 0);
+		hint_start(&hout, test_flg ? -1 : fdout, 1);
+
+		/* A stream handed over by a worker may still hold output, so the
+		 * first round runs without input. */
+		while (ret == LZW_OK)
+		{
+			do
+			{
+				ilen = rsize;
+				olen = osize - ofill;
+				PROF(PROF_COMPUTE);
+				ret = lzw_decode(z, ip, &ilen, obuf + ofill, &olen);
+				PROF(PROF_IO);
+
+				ofill += olen;
+				full = (ofill == osize);
+
+				if (test_flg)
+					ofill = 0;		/* Only extended files are decoded in full */
+				else if (ofill > 0 && (full || obuf == outbuf || ret != LZW_OK))
+				{
+					if (sparse_flg && sized)
+						write_sparse(fdout, obuf, ofill, z->bytes_out - ofill);
+					else if (write(fdout, obuf, ofill) != (ssize_t)ofill)
+						write_error();
+					rate_wait((long)ofill);
+					hint_io(&hout, (long)ofill);
+					PROBE2(write, fdout, ofill);
+					ofill = 0;
+
+					if (!z->ext)
+						resume_point(z->clear_in, z->clear_out, z->maxbits);
+				}
+
+				if (ret != LZW_OK)
+					goto error;
+
+				ip += ilen;
+				rsize -= (int)ilen;
+			}
+			while (rsize > 0 || full);
+
+			if ((rsize = read(fdin, inbuf, IBUFSIZ)) <= 0)
+				break;
+
+			ip = inbuf;
+			rate_wait(rsize);
+			hint_io(&hin, rsize);
+			PROBE2(read, fdin, rsize);
+		}
+
+		if (rsize < 0)
+			read_error();
+
+		if (ret == LZW_OK && z->nhdr == z->hdrlen)
+			ret = lzw_decode_end(z);
+
+		if (ofill > 0)
+		{
+			if (sparse_flg && sized)
+				write_sparse(fdout, obuf, ofill, z->bytes_out - ofill);
+			else if (write(fdout, obuf, ofill) != (ssize_t)ofill)
+				write_error();
+			rate_wait((long)ofill);
+			hint_io(&hout, (long)ofill);
+			PROBE2(write, fdout, ofill);
+		}
+
+error:
+		hint_end(&hin);
+		hint_end(&hout);
+		bytes_in = z->bytes_in;
+		bytes_out = z->bytes_out;
+		filebits = z->maxbits;
+		prof_end(z);
+
+		if (sized && ftruncate(fdout, (off_t)bytes_out) == -1)
+			write_error();
+
+		if (ret == LZW_OK && z->nhdr < z->hdrlen && bytes_in > 0)
+			ret = LZW_EMAGIC;
+
+report:
+		if (ret == LZW_EMAGIC || ret == LZW_EBITS || ret == LZW_EFORMAT)
+			bytes_in = bytes_out = 0;	/* Not uncompressed: comprexx() keeps the file */
+
+		switch (ret)
+		{
+		case LZW_OK:
+			if (list_flg)
+			{
+				size_t n = strlen(ifname);
+
+				if (n == 0)
+					ifname = "stdin";
+				else if (n > 2 && strcmp(ifname + n - 2, ".Z") == 0)
+					n -= 2;
+
+				printf("%12ld %12ld ", bytes_in, bytes_out);
+				prratio(stdout, bytes_out - bytes_in, bytes_out);
+				printf(" %.*s\n", (int)(n > 0 ? n : 5), ifname);
+			}
+			else if (test_flg && !quiet)
+				fprintf(stderr, "%s: OK\n", (ifname[0] != '\0' ? ifname : "stdin"));
+			return;
+
+		case LZW_EMAGIC:
+			fprintf(stderr, "%s: not in compressed format\n",
+								(ifname[0] != '\0'? ifname : "stdin"));
+			exit_code = 1;
+			return;
+
+		case LZW_EBITS:
+			fprintf(stderr,
+					"%s: compressed with %d bits, can only handle %d bits\n",
+					(*ifname != '\0' ? ifname : "stdin"), filebits, maxdbits);
+			exit_code = 4;
+			return;
+
+		case LZW_EFORMAT:
+			fprintf(stderr, "%s: unknown extension of the compressed format\n",
+								(ifname[0] != '\0'? ifname : "stdin"));
+			exit_code = 1;
+			return;
+
+		case LZW_ENOMEM:
+			fprintf(stderr, "Cannot allocate memory for decompression tables.\n");
+			abort_compress();
+			return;
+
+		default:
+			if (test_flg)
+			{/* Go on with the next file */
+				fprintf(stderr, "%s: corrupt input\n",
+								(ifname[0] != '\0' ? ifname : "stdin"));
+				exit_code = 1;
+				return;
+			}
+
+    		fprintf(stderr, "uncompress: corrupt input\n");
+			abort_compress();
+		}
+	}
+
+/*
+ * Reserve the blocks of the file decompress() writes, so that it is laid
+ * out in one piece instead of growing by one write at a time.  How much is
+ * usize if known (from the index), else guessed from the input.  The size
+ * of the file stays as it is, so a guess that is too big does not run into
+ * a file size limit, and file systems that cannot reserve blocks do not
+ * have them written instead; decompress() cuts what is left over past the
+ * data.  Returns 1 if blocks were reserved.
+ */
+int
+prealloc(int fdin, int fdout, long usize)
+	{
+#ifdef PREALLOC
+		struct stat	st;
+		off_t		size;
+
+		if (fstat(fdin, &st) == -1 || (st.st_mode & S_IFMT) != S_IFREG)
+			return 0;
+
+		size = (usize >= 0) ? (off_t)usize : st.st_size * PREALLOC_RATIO;
+
+		return size >= PREALLOC_MIN && fallocate(fdout, FALLOC_FL_KEEP_SIZE, 0, size) == 0;
+#else
+		return 0;
+#endif
+	}
+
+/*
+ * Read the trailer of the extended file fd into ix; the file offset is
+ * left alone.  Returns 1 if fd has a good one, 0 for other files.  The
+ * caller frees ix->seg.
+ */
+int
+read_index(int fd, struct lzw_index *ix)
+	{
+		struct stat	 st;
+		char_type	 hdr[4];
+		char_type	*tail = NULL;
+		char_type	*p;
+		off_t		 pos;
+		long		 ntail;
+		long		 i;
+		int			 ok = 0;
+
+		ix->seg = NULL;
+
+		if (fstat(fd, &st) == -1 || (st.st_mode & S_IFMT) != S_IFREG ||
+			st.st_size < 4 + EXT_SEGSIZ + EXT_FOOTSIZ ||
+			(pos = lseek(fd, 0, SEEK_CUR)) == -1)
+			return 0;
+
+		if (lseek(fd, 0, SEEK_SET) != 0 || read(fd, hdr, 4) != 4 ||
+			hdr[0] != MAGIC_1 || hdr[1] != MAGIC_2 ||
+			!(hdr[2] & EXT_MODE) || hdr[3] != EXT_INDEX ||
+			lseek(fd, st.st_size - EXT_FOOTSIZ, SEEK_SET) == -1 ||
+			(tail = malloc(EXT_FOOTSIZ)) == NULL ||
+			read(fd, tail, EXT_FOOTSIZ) != EXT_FOOTSIZ ||
+			memcmp(tail+16, EXT_MAGIC, 4) != 0)
+			goto out;
+
+		ix->maxbits = hdr[2] & BIT_MASK;
+		ix->nseg = (long)get_le(tail, 4);
+		ix->usize = (long)get_le(tail+4, 8);
+		ntail = ix->nseg*EXT_SEGSIZ + EXT_FOOTSIZ;
+		ix->tstart = (long)st.st_size - ntail;
+		free(tail);
+		tail = NULL;
+
+		if (ix->nseg < 1 || ix->usize < 0 || ix->tstart < 4 ||
+			(tail = malloc(ntail)) == NULL ||
+			(ix->seg = malloc(ix->nseg * sizeof(*ix->seg))) == NULL ||
+			lseek(fd, ix->tstart, SEEK_SET) == -1 ||
+			read(fd, tail, ntail) != ntail ||
+			get_le(tail + ntail - 8, 4) != adler32(1, tail, ntail - 8))
+			goto out;
+
+		for (i = 0, p = tail ; i < ix->nseg ; ++i, p += EXT_SEGSIZ)
+		{
+			ix->seg[i].coff = (long)get_le(p, 8);
+			ix->seg[i].uoff = (long)get_le(p+8, 8);
+			ix->seg[i].sum = (uint32_t)get_le(p+16, 4);
+
+			/* The segments must follow each other in both files */
+			if (i == 0 ? (ix->seg[i].coff != 4 || ix->seg[i].uoff != 0) :
+						 (ix->seg[i].coff <= ix->seg[i-1].coff ||
+						  ix->seg[i].uoff <= ix->seg[i-1].uoff))
+				goto out;
+		}
+
+		ok = (ix->seg[ix->nseg-1].coff < ix->tstart &&
+			  ix->seg[ix->nseg-1].uoff <= ix->usize);
+
+out:
+		free(tail);
+		if (!ok)
+		{
+			free(ix->seg);
+			ix->seg = NULL;
+		}
+
+		if (lseek(fd, pos, SEEK_SET) != pos)
+			read_error();
+
+		return ok;
+	}
+
+/*
+ * --sparse: write len bytes of buf, which go to offset pos of fd, seeking
+ * over the blocks that are all zero instead of writing them.  Blocks cut
+ * short by the ends of buf are always written.
+ */
+void
+write_sparse(int fd, const char_type *buf, size_t len, long pos)
+	{
+		size_t	n;
+		size_t	m;
+		int		hole;
+		int		zero;
+
+		while (len > 0)
+		{
+			hole = -1;
+
+			for (n = 0 ; n < len ; n += m)
+			{/* A run of blocks of the same kind */
+				m = SPARSE_BLOCK - (size_t)((pos + n) % SPARSE_BLOCK);
+				if (m > len - n)
+					m = len - n;
+
+				/* memcmp() is about as fast as reading the block */
+				zero = (m == SPARSE_BLOCK && buf[n] == 0 &&
+						memcmp(buf + n, buf + n + 1, m - 1) == 0);
+
+				if (hole == -1)
+					hole = zero;
+				else if (zero != hole)
+					break;
+			}
+
+			if (hole)
+			{
+				if (lseek(fd, (off_t)n, SEEK_CUR) == -1)
+					write_error();
+			}
+			else if (write(fd, buf, n) != (ssize_t)n)
+				write_error();
+
+			buf += n;
+			len -= n;
+			pos += n;
+		}
+	}
+
+/*
+ * Fill the block buffer of one side of compare(), uncompressing if needed.
+ * Returns the number of bytes in the buffer; less than CMPBUFSIZ only at
+ * end of file.  -1 on error.
+ */
+long
+cmp_fill(struct cmp_side *s)
+	{
+		size_t	n = 0;
+		size_t	ilen;
+		size_t	olen;
+		ssize_t	rsize;
+		int		ret;
+
+		while (n < CMPBUFSIZ)
+		{
+			if (s->z == NULL)
+			{
+				if ((rsize = read(s->fd, s->buf+n, CMPBUFSIZ-n)) < 0)
+					goto rerror;
+				if (rsize == 0)
+					break;
+				n += rsize;
+				continue;
+			}
+
+			if (s->ilen == 0 && !s->eof)
+			{
+				if ((rsize = read(s->fd, s->ibuf, IBUFSIZ)) < 0)
+					goto rerror;
+				s->ip = s->ibuf;
+				s->ilen = rsize;
+				s->eof = (rsize == 0);
+			}
+
+			ilen = s->ilen;
+			olen = CMPBUFSIZ-n;
+			ret = lzw_decode(s->z, s->ip, &ilen, s->buf+n, &olen);
+			s->ip += ilen;
+			s->ilen -= ilen;
+			n += olen;
+
+			if (ret == LZW_OK && s->eof && s->z->nhdr < s->z->hdrlen && s->z->bytes_in > 0)
+				ret = LZW_EMAGIC;
+
+			if (ret == LZW_OK && s->eof && n < CMPBUFSIZ && s->z->nhdr == s->z->hdrlen)
+				ret = lzw_decode_end(s->z);
+
+			if (decode_error(s->name, ret, s->z))
+				return -1;
+
+			if (s->eof && olen == 0)
+				break;
+		}
+
+		return (long)n;
+
+rerror:
+		fprintf(stderr, "%s: read error on ", progname);
+		perror(s->name);
+		return -1;
+	}
+
+/*
+ * Compare two files like cmp(1), uncompressing those ending in .Z in
+ * lockstep.  With only name1, name1.Z is compared with name1.
+ * Returns 0 if the data is identical, 1 if it differs and 2 on trouble.
+ */
+int
+compare(const char *name1, const char *name2)
+	{
+		struct lzw_stream	z2;
+		struct cmp_side		side[2];
+		char			   *tmpname = NULL;
+		long				n[2];
+		long				len;
+		long				i;
+		intmax_t			offset = 0;
+		intmax_t			line = 1;
+		const char_type	   *p;
+		const char_type	   *e;
+		size_t				nlen;
+		int					ret = 2;
+		int					k;
+
+		if (name2 == NULL)
+		{
+			nlen = strlen(name1);
+			if (nlen > 2 && strcmp(name1+nlen-2, ".Z") == 0)
+				nlen -= 2;
+
+			if ((tmpname = malloc(2*nlen+4)) == NULL)
+			{
+				fprintf(stderr, "%s: out of memory\n", progname);
+				return 2;
+			}
+
+			memcpy(tmpname, name1, nlen);
+			strcpy(tmpname+nlen, ".Z");
+			memcpy(tmpname+nlen+3, name1, nlen);
+			tmpname[2*nlen+3] = '\0';
+			name1 = tmpname;
+			name2 = tmpname+nlen+3;
+		}
+
+		memset(&z2, 0, sizeof(z2));
+		memset(side, 0, sizeof(side));
+		side[0].name = name1;
+		side[1].name = name2;
+		side[0].fd = side[1].fd = -1;
+
+		for (k = 0 ; k < 2 ; ++k)
+		{
+			struct cmp_side	*s = &side[k];
+
+			nlen = strlen(s->name);
+			if (nlen > 2 && strcmp(s->name+nlen-2, ".Z") == 0)
+			{
+				s->z = (k == 0) ? &engine : &z2;
+				if (lzw_init(s->z, 0, maxdbits) != LZW_OK ||
+					(s->ibuf = malloc(IBUFSIZ)) == NULL)
+				{
+					fprintf(stderr, "Cannot allocate memory for decompression tables.\n");
+					goto out;
+				}
+			}
+
+			if ((s->buf = malloc(CMPBUFSIZ)) == NULL)
+			{
+				fprintf(stderr, "%s: out of memory\n", progname);
+				goto out;
+			}
+
+			if (strcmp(s->name, "-") == 0)
+				s->fd = 0;
+			else if ((s->fd = open(s->name, O_RDONLY|O_BINARY)) < 0)
+			{
+				perror(s->name);
+				goto out;
+			}
+		}
+
+		for (;;)
+		{
+			if ((n[0] = cmp_fill(&side[0])) < 0 || (n[1] = cmp_fill(&side[1])) < 0)
+				goto out;
+
+			len = (n[0] < n[1]) ? n[0] : n[1];
+
+			if (memcmp(side[0].buf, side[1].buf, len) != 0)
+			{
+				for (i = 0 ; side[0].buf[i] == side[1].buf[i] ; ++i)
+					;
+
+				for (p = side[0].buf, e = p+i ;
+					 (p = memchr(p, '\n', e-p)) != NULL ; ++p)
+					++line;
+
+				printf("%s %s differ: byte %jd, line %jd\n",
+						side[0].name, side[1].name, offset+i+1, line);
+				ret = 1;
+				goto out;
+			}
+
+			if (n[0] != n[1])
+			{
+				fprintf(stderr, "%s: EOF on %s\n", progname,
+						side[n[0] < n[1] ? 0 : 1].name);
+				ret = 1;
+				goto out;
+			}
+
+			if (n[0] < CMPBUFSIZ)
+				break;
+
+			for (p = side[0].buf, e = p+len ;
+				 (p = memchr(p, '\n', e-p)) != NULL ; ++p)
+				++line;
+
+			offset += len;
+		}
+
+		ret = 0;
+
+out:
+		for (k = 0 ; k < 2 ; ++k)
+		{
+			if (side[k].fd > 0)
+				close(side[k].fd);
+			free(side[k].ibuf);
+			free(side[k].buf);
+		}
+
+		lzw_free(&z2);
+
+		free(tmpname);
+
+		return ret;
+	}
+
+/*
+ * Report an error ret of lzw_decode() on name; 0 if ret is no error.
+ */
+int
+decode_error(const char *name, int ret, const struct lzw_stream *z)
+	{
+		switch (ret)
+		{
+		case LZW_OK:
+			return 0;
+
+		case LZW_EMAGIC:
+			fprintf(stderr, "%s: not in compressed format\n", name);
+			break;
+
+		case LZW_EFORMAT:
+			fprintf(stderr, "%s: unknown extension of the compressed format\n", name);
+			break;
+
+		case LZW_EBITS:
+			fprintf(stderr,
+					"%s: compressed with %d bits, can only handle %d bits\n",
+					name, z->maxbits, maxdbits);
+			break;
+
+		case LZW_ENOMEM:
+			fprintf(stderr, "Cannot allocate memory for decompression tables.\n");
+			break;
+
+		default:
+			fprintf(stderr, "%s: corrupt input\n", name);
+			break;
+		}
+
+		return 1;
+	}
+
+/*
+ * --grep: find the string pat of plen bytes in [p, end).  memmem() is
+ * vectorised in glibc; elsewhere memchr() looks for the first byte.
+ */
+const char_type *
+grep_find(const char_type *p, const char_type *end, const char *pat, size_t plen)
+	{
+#ifdef __linux__
+		return memmem(p, end-p, pat, plen);
+#else
+		for (end -= plen-1 ; p < end ; ++p)
+		{
+			if ((p = memchr(p, pat[0], end-p)) == NULL)
+				break;
+			if (memcmp(p, pat, plen) == 0)
+				return p;
+		}
+
+		return NULL;
+#endif
+	}
+
+/*
+ * --grep: write the lines of name (stdin if NULL) that contain grep_pat,
+ * uncompressing it if its name ends in .Z or it is stdin.  The blocks of
+ * cmp_fill() are searched where they are decoded; the unfinished last line
+ * of a block is moved to the front and searched again with the next one,
+ * so matches across blocks are found and lines are written whole.
+ */
+void
+grep_file(const char *name)
+	{
+		struct cmp_side		 s;
+		char_type			*base = NULL;
+		const char_type		*p;
+		const char_type		*end;
+		const char_type		*hit;
+		const char_type		*ls;
+		const char_type		*le;
+		const char_type		*cnt;
+		size_t				 plen = strlen(grep_pat);
+		size_t				 size = 2*CMPBUFSIZ;
+		size_t				 keep = 0;
+		size_t				 from = 0;
+		intmax_t			 offset = 0;
+		intmax_t			 line = 1;
+		long				 n;
+		int					 eof = 0;
+
+		memset(&s, 0, sizeof(s));
+		s.name = (name != NULL) ? name : "(standard input)";
+		s.fd = 0;
+
+		if (name == NULL || (strlen(name) > 2 && strcmp(name+strlen(name)-2, ".Z") == 0))
+		{
+			s.z = &engine;
+			if (lzw_init(s.z, 0, maxdbits) != LZW_OK ||
+				(s.ibuf = malloc(IBUFSIZ)) == NULL)
+			{
+				fprintf(stderr, "Cannot allocate memory for decompression tables.\n");
+				goto error;
+			}
+		}
+
+		if ((base = malloc(size)) == NULL)
+		{
+			fprintf(stderr, "%s: out of memory\n", progname);
+			goto error;
+		}
+
+		if (name != NULL && (s.fd = open(name, O_RDONLY|O_BINARY)) < 0)
+		{
+			perror(name);
+			goto error;
+		}
+
+		while (!eof)
+		{
+			if (keep + CMPBUFSIZ > size)
+			{/* A line longer than a block */
+				size *= 2;
+				if ((p = realloc(base, size)) == NULL)
+				{
+					fprintf(stderr, "%s: out of memory\n", progname);
+					goto error;
+				}
+				base = (char_type *)p;
+			}
+
+			s.buf = base + keep;
+			if ((n = cmp_fill(&s)) < 0)
+				goto error;
+
+			eof = (n < CMPBUFSIZ);
+			end = base + keep + n;
+			cnt = base;
+			p = base + from;
+
+			while ((hit = grep_find(p, end, grep_pat, plen)) != NULL)
+			{
+				for (ls = hit ; ls > base && ls[-1] != '\n' ; --ls)
+					;
+
+				if ((le = memchr(hit, '\n', end-hit)) == NULL)
+				{
+					if (!eof)
+						break;		/* The rest of the line is in the next block */
+					le = end;
+				}
+
+				if (grep_ret != 2)
+					grep_ret = 0;
+
+				if (list_flg)
+				{
+					printf("%s\n", s.name);
+					goto out;
+				}
+
+				for ( ; (cnt = memchr(cnt, '\n', ls-cnt)) != NULL ; ++cnt)
+					++line;
+				cnt = ls;
+
+				printf("%s:%jd:%jd:", s.name, line, offset + (ls-base));
+				fwrite(ls, 1, le-ls, stdout);
+				putchar('\n');
+
+				if (le == end)
+					break;
+				p = le+1;
+			}
+
+			/* Keep the unfinished line; only its last plen-1 bytes, or what
+			 * follows a match in it, are still to be searched */
+			for (ls = end ; ls > base && ls[-1] != '\n' ; --ls)
+				;
+
+			for ( ; (cnt = memchr(cnt, '\n', ls-cnt)) != NULL ; ++cnt)
+				++line;
+
+			keep = end - ls;
+			from = (hit != NULL) ? (size_t)(hit - ls) : (keep >= plen ? keep - plen + 1 : 0);
+			offset += ls - base;
+			memmove(base, ls, keep);
+		}
+
+out:
+		if (ferror(stdout))
+			write_error();
+
+		if (s.fd > 0)
+			close(s.fd);
+		free(s.ibuf);
+		free(base);
+		return;
+
+error:
+		grep_ret = 2;
+		goto out;
+	}
+
+/*
+ * --grep: search the file path ("-" is stdin), or with -r the files under it.
+ */
+void
+grep_path(const char *path)
+	{
+		struct stat		st;
+
+		if (strcmp(path, "-") == 0)
+			grep_file(NULL);
+		else if (stat(path, &st) == -1)
+		{
+			perror(path);
+			grep_ret = 2;
+		}
+		else if (S_ISDIR(st.st_mode))
+		{
+#ifdef	RECURSIVE
+			if (recursive)
+				compdir((char *)path, grep_path);
+			else
+#endif
+			if (!quiet)
+				fprintf(stderr, "%s is a directory -- ignored\n", path);
+		}
+		else
+			grep_file(path);
+	}
+
+/*
+ * --concat: join the compressed files names[1..] into names[0] without
+ * uncompressing them.  A decoder that has read the codes of one file and
+ * then reads a CLEAR is in the same state as at the start of a file, so
+ * the codes of each file after the first follow a CLEAR in the width of
+ * the last code before it, padded to the end of its group as usual.
+ * Returns the exit status.
+ */
+int
+concat(char **names)
+	{
+		struct concat_tail	 tail;
+		struct stat			 ost;
+		struct stat			 st;
+		int					 fdout;
+		int					 bits = 0;
+		int					 i;
+
+		if (stat(names[0], &ost) == 0)
+		{
+			for (i = 1 ; names[i] != NULL ; ++i)
+				if (stat(names[i], &st) == 0 &&
+					st.st_dev == ost.st_dev && st.st_ino == ost.st_ino)
+				{
+					fprintf(stderr, "%s is also an input\n", names[0]);
+					return 1;
+				}
+
+			if (!force)
+			{
+				fprintf(stderr, "%s already exists.\n", names[0]);
+				return 1;
+			}
+		}
+
+		if ((fdout = open(names[0], O_WRONLY|O_CREAT|O_TRUNC|O_BINARY, 0666)) == -1)
+		{
+			perror(names[0]);
+			return 1;
+		}
+
+		ofname = names[0];
+		remove_ofname = 1;
+		memset(&tail, 0, sizeof(tail));
+
+		for (i = 1 ; names[i] != NULL ; ++i)
+			if (concat_part(fdout, names[i], &tail, &bits))
+				abort_compress();
+
+		concat_tail_out(fdout, &tail, 0);
+
+		if (close(fdout))
+			write_error();
+
+		remove_ofname = 0;
+		return 0;
+	}
+
+/*
+ * --concat: append the codes of name to fdout.  The last bytes of them
+ * stay in tail, to be followed by a CLEAR when another file comes.  The
+ * first file sets the header, *bits; files in another format or with other
+ * maxbits are recompressed to match it.  Returns non-zero on error.
+ */
+int
+concat_part(int fdout, const char *name, struct concat_tail *tail, int *bits)
+	{
+		char_type	hdr[3];
+		ssize_t		rsize;
+		size_t		ilen;
+		size_t		olen;
+		long		body = 0;
+		long		end;
+		int			nhold = 0;
+		int			from;
+		int			recoded = 0;
+		int			fd;
+		int			ret;
+
+		if ((fd = open(name, O_RDONLY|O_BINARY)) == -1)
+		{
+			perror(name);
+			return -1;
+		}
+
+again:
+		if ((rsize = read(fd, hdr, 3)) < 0)
+			goto rerror;
+		if (rsize < 3 || hdr[0] != MAGIC_1 || hdr[1] != MAGIC_2)
+		{
+			fprintf(stderr, "%s: not in compressed format\n", name);
+			goto error;
+		}
+
+		if (*bits == 0)
+		{
+			*bits = ((hdr[2] & BLOCK_MODE) && !(hdr[2] & EXT_MODE)) ?
+						hdr[2] & BIT_MASK : maxbits;
+			inbuf[0] = MAGIC_1;
+			inbuf[1] = MAGIC_2;
+			inbuf[2] = (char_type)(*bits | BLOCK_MODE);
+			if (write(fdout, inbuf, 3) != 3)
+				write_error();
+		}
+
+		if (!(hdr[2] & BLOCK_MODE) || (hdr[2] & EXT_MODE) || (hdr[2] & BIT_MASK) != *bits)
+		{/* Codes a decoder of this header cannot follow */
+			if (recoded || (ret = concat_recode(fd, name, *bits)) == -1)
+				goto error;
+
+			close(fd);
+			fd = ret;
+			recoded = 1;
+			goto again;
+		}
+
+		if (lzw_init(&engine, 0, maxdbits) != LZW_OK)
+		{
+			fprintf(stderr, "Cannot allocate memory for decompression tables.\n");
+			goto error;
+		}
+
+		engine.test = 1;
+		ilen = 3;
+		olen = OBUFSIZ;
+		if (decode_error(name, lzw_decode(&engine, hdr, &ilen, outbuf, &olen), &engine))
+			goto error;
+
+		while ((rsize = read(fd, inbuf+nhold, IBUFSIZ)) > 0)
+		{
+			ilen = rsize;
+			olen = OBUFSIZ;
+			if (decode_error(name, lzw_decode(&engine, inbuf+nhold, &ilen, outbuf, &olen), &engine))
+				goto error;
+
+			body += rsize;
+			nhold += (int)rsize;
+
+			if (nhold > CONCAT_HOLD)
+			{/* All but the last bytes can go */
+				concat_tail_out(fdout, tail, 1);
+
+				if (write(fdout, inbuf, nhold-CONCAT_HOLD) != nhold-CONCAT_HOLD)
+					write_error();
+
+				memmove(inbuf, inbuf+nhold-CONCAT_HOLD, CONCAT_HOLD);
+				nhold = CONCAT_HOLD;
+			}
+		}
+
+		if (rsize < 0)
+			goto rerror;
+
+		if (engine.codes > 0)
+		{
+			concat_tail_out(fdout, tail, 1);
+
+			/* The codes end before the bits the decoder has not used */
+			end = 8*body - engine.bitcnt;
+			from = (int)((end >> 3) - (body - nhold));
+			if (from > 0 && write(fdout, inbuf, from) != from)
+				write_error();
+
+			tail->set = 1;
+			tail->len = nhold - from;
+			memcpy(tail->buf, inbuf+from, tail->len);
+			tail->bits = (int)(end & 7);
+			tail->skip = engine.skip;
+			tail->ngroup = engine.ngroup;
+			tail->n_bits = engine.n_bits;
+			tail->grow = (engine.free_ent > engine.maxcode);
+		}
+
+		if (!quiet)
+			fprintf(stderr, "%s: %s to %s\n", name,
+					recoded ? "recompressed and appended" : "appended", ofname);
+
+		close(fd);
+		return 0;
+
+rerror:
+		fprintf(stderr, "%s: read error on ", progname);
+		perror(name);
+error:
+		close(fd);
+		return -1;
+	}
+
+/*
+ * --concat: uncompress fd and compress it again with maxbits bits into a
+ * temporary file.  Returns its descriptor, at the start, or -1.
+ */
+int
+concat_recode(int fd, const char *name, int bits)
+	{
+		struct lzw_stream	 dec;
+		struct cmp_side		 s;
+		FILE				*tmp;
+		const char_type		*ip;
+		size_t				 ilen;
+		size_t				 olen;
+		long				 len;
+		long				 n;
+		int					 tfd = -1;
+
+		memset(&dec, 0, sizeof(dec));
+		memset(&s, 0, sizeof(s));
+		s.name = name;
+		s.fd = fd;
+		s.z = &dec;
+
+		if (lzw_init(&dec, 0, maxdbits) != LZW_OK || lzw_init(&engine, 1, bits) != LZW_OK ||
+			(s.ibuf = malloc(IBUFSIZ)) == NULL || (s.buf = malloc(CMPBUFSIZ)) == NULL)
+		{
+			fprintf(stderr, "Cannot allocate memory for compression tables.\n");
+			goto out;
+		}
+
+		engine.best = best_flg;
+
+		if ((tmp = tmpfile()) == NULL || (tfd = dup(fileno(tmp))) == -1)
+		{
+			perror("tmpfile");
+			if (tmp != NULL)
+				fclose(tmp);
+			goto out;
+		}
+		fclose(tmp);
+
+		if (lseek(fd, 0, SEEK_SET) != 0)
+		{
+			perror(name);
+			goto error;
+		}
+
+		do
+		{
+			if ((len = cmp_fill(&s)) < 0)
+				goto error;
+
+			for (ip = s.buf, n = len ; n > 0 ; ip += ilen, n -= (long)ilen)
+			{
+				ilen = n;
+				olen = OBUFSIZ;
+				lzw_encode(&engine, ip, &ilen, outbuf, &olen, 0);
+				if (olen > 0 && write(tfd, outbuf, olen) != (ssize_t)olen)
+					goto werror;
+			}
+		}
+		while (len == CMPBUFSIZ);
+
+		do
+		{
+			ilen = 0;
+			olen = OBUFSIZ;
+			n = lzw_encode(&engine, inbuf, &ilen, outbuf, &olen, 1);
+			if (olen > 0 && write(tfd, outbuf, olen) != (ssize_t)olen)
+				goto werror;
+		}
+		while (n != LZW_END);
+
+		if (lseek(tfd, 0, SEEK_SET) == 0)
+			goto out;
+
+werror:
+		perror("tmpfile");
+error:
+		close(tfd);
+		tfd = -1;
+out:
+		lzw_free(&dec);
+		free(s.ibuf);
+		free(s.buf);
+		return tfd;
+	}
+
+/*
+ * --concat: write what is left of the last file copied.  With clear, a
+ * CLEAR follows its last code, after the padding the decoder skips if it
+ * has to widen the codes first, and is padded to the end of its group, so
+ * the next file starts on a byte.
+ */
+void
+concat_tail_out(int fdout, struct concat_tail *tail, int clear)
+	{
+		char_type	out[CONCAT_HOLD + 3*MAXBITS];
+		long		pos;
+		int			ngroup = tail->ngroup;
+		int			n_bits = tail->n_bits;
+		int			n = tail->len;
+		int			i;
+
+		if (!tail->set)
+			return;
+
+		memset(out, 0, sizeof(out));
+		memcpy(out, tail->buf, tail->len);
+
+		if (clear)
+		{/* Only the bits of the codes are kept */
+			out[0] &= (1 << tail->bits) - 1;
+			memset(out+1, 0, sizeof(out)-1);
+			pos = tail->bits + tail->skip;
+
+			if (tail->grow)
+			{
+				pos += group_padding(ngroup, n_bits);
+				ngroup = 0;
+				++n_bits;
+			}
+
+			for (i = 0 ; i < n_bits ; ++i, ++pos)
+				if ((CLEAR >> i) & 1)
+					out[pos >> 3] |= 1 << (pos & 7);
+
+			ngroup = (ngroup+1)&7;
+			pos += group_padding(ngroup, n_bits);
+			n = (int)(pos >> 3);
+		}
+
+		if (n > 0 && write(fdout, out, n) != n)
+			write_error();
+
+		tail->set = 0;
+	}
+
+/*
+ * --append: compress the standard input onto the end of name, in place, so
+ * that it ends up as if all of the data had been compressed at once.  The
+ * compressor after a CLEAR depends on nothing but where the CLEAR is, so
+ * it is set up at the last CLEAR in the file (or at the start) and the
+ * data from there is uncompressed and compressed again.  That must give
+ * the codes in the file, to its last byte, or name was compressed some
+ * other way and is left alone; otherwise the compressor carries on from
+ * the codes it has not written yet with the new data.
+ * Returns the exit status.
+ */
+int
+append(const char *name)
+	{
+		struct lzw_stream	 dec;
+		struct lzw_stream	 fin;
+		struct cmp_side		 s;
+		char_type			 hdr[3];
+		const char_type		*ip;
+		ssize_t				 rsize;
+		size_t				 ilen;
+		size_t				 olen;
+		long				 pos;
+		long				 len;
+		long				 got;
+		int					 ret = 1;
+		int					 fd;
+
+		memset(&dec, 0, sizeof(dec));
+		memset(&s, 0, sizeof(s));
+		ofname = (char *)name;
+		remove_ofname = 0;
+
+		if ((fd = open(name, O_RDWR|O_BINARY)) == -1)
+		{
+			perror(name);
+			return 1;
+		}
+
+		if ((rsize = read(fd, hdr, 3)) < 0)
+			read_error();
+		if (rsize < 3 || hdr[0] != MAGIC_1 || hdr[1] != MAGIC_2)
+		{
+			fprintf(stderr, "%s: not in compressed format\n", name);
+			goto out;
+		}
+
+		if (!(hdr[2] & BLOCK_MODE) || (hdr[2] & EXT_MODE))
+		{
+			fprintf(stderr, "%s: can only append to files in the block mode format\n", name);
+			goto out;
+		}
+
+		/* Find the last CLEAR */
+		if (lzw_init(&engine, 0, maxdbits) != LZW_OK)
+		{
+			fprintf(stderr, "Cannot allocate memory for decompression tables.\n");
+			goto out;
+		}
+
+		engine.test = 1;
+		ilen = 3;
+		olen = OBUFSIZ;
+		if (decode_error(name, lzw_decode(&engine, hdr, &ilen, outbuf, &olen), &engine))
+			goto out;
+
+		while ((rsize = read(fd, inbuf, IBUFSIZ)) > 0)
+		{
+			ilen = rsize;
+			olen = OBUFSIZ;
+			if (decode_error(name, lzw_decode(&engine, inbuf, &ilen, outbuf, &olen), &engine))
+				goto out;
+		}
+
+		if (rsize < 0)
+			read_error();
+
+		pos = (engine.clear_in > 0) ? engine.clear_in : 3;
+		len = engine.clear_out;
+
+		/* Uncompress from there and compress again */
+		s.name = name;
+		s.fd = fd;
+		s.z = &dec;
+		ilen = 3;
+		olen = OBUFSIZ;
+		if (lzw_init(&dec, 0, maxdbits) != LZW_OK ||
+			lzw_decode(&dec, hdr, &ilen, outbuf, &olen) != LZW_OK ||
+			lzw_init(&engine, 1, hdr[2] & BIT_MASK) != LZW_OK ||
+			(s.ibuf = malloc(IBUFSIZ)) == NULL || (s.buf = malloc(CMPBUFSIZ)) == NULL)
+		{
+			fprintf(stderr, "Cannot allocate memory for compression tables.\n");
+			goto out;
+		}
+
+		engine.nhdr = engine.hdrlen;
+		engine.bytes_out = pos;
+		engine.bytes_in = len;
+		if (pos > 3)
+			engine.checkpoint = len + 1 + CHECK_GAP;	/* The check that caused the CLEAR */
+
+		if (lseek(fd, pos, SEEK_SET) != pos)
+			read_error();
+
+		do
+		{
+			if ((got = cmp_fill(&s)) < 0)
+				goto out;
+
+			for (ip = s.buf, len = got ; len > 0 ; ip += ilen, len -= (long)ilen)
+			{
+				ilen = len;
+				olen = OBUFSIZ;
+				lzw_encode(&engine, ip, &ilen, outbuf, &olen, 0);
+				if (append_check(fd, pos, outbuf, olen))
+					goto mismatch;
+				pos += (long)olen;
+			}
+		}
+		while (got == CMPBUFSIZ);
+
+		/* The last codes, which the new data replaces */
+		fin = engine;
+		len = pos;
+		do
+		{
+			ilen = 0;
+			olen = OBUFSIZ;
+			got = lzw_encode(&fin, inbuf, &ilen, outbuf, &olen, 1);
+			if (append_check(fd, len, outbuf, olen))
+				goto mismatch;
+			len += (long)olen;
+		}
+		while (got != LZW_END);
+
+		if (len != lseek(fd, 0, SEEK_END))
+			goto mismatch;
+
+		/* Carry on with the new data; only the replay has to be greedy */
+		engine.best = best_flg;
+		if (lseek(fd, pos, SEEK_SET) != pos)
+			write_error();
+
+		setmode(0, O_BINARY);
+		while ((rsize = read(0, inbuf, IBUFSIZ)) > 0)
+		{
+			for (ip = inbuf ; rsize > 0 ; ip += ilen, rsize -= (ssize_t)ilen)
+			{
+				ilen = rsize;
+				olen = OBUFSIZ;
+				lzw_encode(&engine, ip, &ilen, outbuf, &olen, 0);
+				if (olen > 0 && write(fd, outbuf, olen) != (ssize_t)olen)
+					write_error();
+			}
+		}
+
+		if (rsize < 0)
+			perror("stdin");	/* The file still gets the data read so far */
+
+		do
+		{
+			ilen = 0;
+			olen = OBUFSIZ;
+			got = lzw_encode(&engine, inbuf, &ilen, outbuf, &olen, 1);
+			if (olen > 0 && write(fd, outbuf, olen) != (ssize_t)olen)
+				write_error();
+		}
+		while (got != LZW_END);
+
+		if (ftruncate(fd, engine.bytes_out) != 0)
+			write_error();
+
+		if (!quiet)
+			fprintf(stderr, "%s: %ld bytes, %ld compressed\n", name,
+					engine.bytes_in, engine.bytes_out);
+
+		ret = (rsize < 0);
+		goto out;
+
+mismatch:
+		fprintf(stderr, "%s: not compressed the way this compress does, cannot append\n", name);
+out:
+		if (close(fd))
+			write_error();
+		lzw_free(&dec);
+		free(s.ibuf);
+		free(s.buf);
+		return ret;
+	}
+
+/*
+ * --append: check that the n bytes at pos in fd are those in buf.
+ */
+int
+append_check(int fd, long pos, const char_type *buf, size_t n)
+	{
+		char_type	file[OBUFSIZ];
+
+		if (n > 0 && pread(fd, file, n, pos) != (ssize_t)n)
+			return 1;
+
+		return memcmp(file, buf, n) != 0;
+	}
+
+/*
+ * --split: cut name into up to split_n files of about the same size, at
+ * CLEAR codes, so that each can be uncompressed by itself.  The codes
+ * after a CLEAR start at a byte and in the state of a new file, so a piece
+ * is the bytes from there up to a later CLEAR behind a header of its own;
+ * nothing is recompressed.  The file is uncompressed without output first
+ * to find the CLEARs.  The name, offset and size of the uncompressed data
+ * of every piece go to stdout.  Returns the exit status.
+ */
+int
+split(const char *name)
+	{
+		struct split_cut	*cut = NULL;
+		struct split_cut	*p;
+		struct stat			 st;
+		const char_type		*ip;
+		ssize_t				 rsize;
+		size_t				 ilen;
+		size_t				 olen;
+		char				*pname = NULL;
+		long				 ncut = 0;
+		long				 maxcut = 0;
+		long				 end;
+		long				 from;
+		long				 want;
+		long				 size;
+		long				 uoff = 0;
+		int					 digits = 1;
+		int					 npiece = 0;
+		int					 n;
+		int					 ret = 1;
+		int					 fd;
+		long				 i;
+
+		if ((fd = open(name, O_RDONLY|O_BINARY)) == -1 || fstat(fd, &st) == -1)
+		{
+			perror(name);
+			return 1;
+		}
+
+		if (lzw_init(&engine, 0, maxdbits) != LZW_OK)
+		{
+			fprintf(stderr, "Cannot allocate memory for decompression tables.\n");
+			goto out;
+		}
+
+		engine.test = 1;
+		engine.stopclear = 1;
+
+		while ((rsize = read(fd, inbuf, IBUFSIZ)) > 0)
+		{
+			for (ip = inbuf ; ; ip += ilen, rsize -= (ssize_t)ilen)
+			{
+				ilen = rsize;
+				olen = OBUFSIZ;
+				if (decode_error(name, lzw_decode(&engine, ip, &ilen, outbuf, &olen), &engine))
+					goto out;
+
+				if (engine.clear_in > (ncut > 0 ? cut[ncut-1].in : 0))
+				{/* Stopped at a CLEAR */
+					if (ncut == maxcut)
 					{
-						long disp;
+						maxcut = maxcut ? 2*maxcut : 64;
+						if ((p = realloc(cut, maxcut*sizeof(*cut))) == NULL)
+						{
+							fprintf(stderr, "%s: out of memory\n", progname);
+							goto out;
+						}
+						cut = p;
+					}
+
+					cut[ncut].at = engine.clear_at;
+					cut[ncut].in = engine.clear_in;
+					cut[ncut].out = engine.clear_out;
+					++ncut;
+				}
+				else if (ilen == 0)
+					break;
+			}
+		}
+
+		if (rsize < 0)
+		{
+			perror(name);
+			goto out;
+		}
+
+		if (engine.nhdr < engine.hdrlen || decode_error(name, lzw_decode_end(&engine), &engine))
+		{
+			if (engine.nhdr < engine.hdrlen)
+				fprintf(stderr, "%s: not in compressed format\n", name);
+			goto out;
+		}
+
+		/* The extended format ends in two CLEARs and the index */
+		end = 8*(long)st.st_size;
+		if (engine.ext && ncut > 0)
+			end = cut[--ncut].at;
+
+		size = (long)strlen(name);
+		if (size > 2 && strcmp(name+size-2, ".Z") == 0)
+			size -= 2;
+		for (n = split_n ; n >= 10 ; n /= 10)
+			++digits;
+		if ((pname = malloc(size + 20)) == NULL)
+		{
+			fprintf(stderr, "%s: out of memory\n", progname);
+			goto out;
+		}
+
+		/* Cut at the first CLEAR past every split_n-th of the codes */
+		from = engine.hdrlen;
+		want = (end/8 - from) / split_n;
+		for (i = 0 ; i <= ncut ; ++i)
+		{
+			if (i < ncut && (cut[i].at/8 - engine.hdrlen < (npiece+1)*want || npiece+1 == split_n))
+				continue;
+
+			sprintf(pname, "%.*s.%0*d.Z", (int)size, name, digits & 15, ++npiece);
+			if (split_piece(fd, pname, engine.hdr[2] & ~EXT_MODE, from, i < ncut ? cut[i].at : end))
+				goto out;
+
+			printf("%s %ld %ld\n", pname, uoff, (i < ncut ? cut[i].out : engine.bytes_out) - uoff);
+
+			if (i < ncut)
+			{
+				from = cut[i].in;
+				uoff = cut[i].out;
+			}
+		}
+
+		ret = 0;
+
+out:
+		close(fd);
+		free(cut);
+		free(pname);
+		return ret;
+	}
+
+/*
+ * --split: write the bits [from*8, end) of fd behind a header with the
+ * mode byte mode to the new file pname.
+ */
+int
+split_piece(int fd, const char *pname, int mode, long from, long end)
+	{
+		ssize_t	rsize;
+		long	n;
+		int		fdout;
+
+		if (!force && access(pname, F_OK) == 0)
+		{
+			fprintf(stderr, "%s already exists.\n", pname);
+			return -1;
+		}
+
+		if ((fdout = open(pname, O_WRONLY|O_CREAT|O_TRUNC|O_BINARY, 0666)) == -1)
+		{
+			perror(pname);
+			return -1;
+		}
+
+		ofname = (char *)pname;
+		remove_ofname = 1;
+
+		outbuf[0] = MAGIC_1;
+		outbuf[1] = MAGIC_2;
+		outbuf[2] = (char_type)mode;
+		if (write(fdout, outbuf, 3) != 3)
+			write_error();
+
+		for ( ; from < (end+7)/8 ; from += rsize)
+		{
+			n = min((end+7)/8 - from, IBUFSIZ);
+			if ((rsize = pread(fd, inbuf, n, from)) <= 0)
+				read_error();
+
+			if (from + rsize == (end+7)/8 && (end & 7))
+				inbuf[rsize-1] &= (1 << (end & 7)) - 1;	/* The CLEAR is not in it */
+
+			if (write(fdout, inbuf, rsize) != rsize)
+				write_error();
+		}
+
+		if (close(fdout))
+			write_error();
+
+		remove_ofname = 0;
+		return 0;
+	}
+
+#ifdef PTHREADS
+/*
+ * zcat -j: decode the files of the command line ahead on worker threads.
+ * With list NULL the files come from --files-from instead; the names of
+ * the files from the current one on are kept in pfring.
+ *
+ * Every slot has its own thread, stream and output buffer; file i goes to
+ * slot i % npf, so the slots hand their files to the main thread in
+ * command line order.  The main thread still goes through comprexx() for
+ * every file and only picks up the output of a slot in decompress(), when
+ * the file it opened is the one the worker decoded.  A file whose output
+ * does not fit in the buffer stops the worker; the main thread writes what
+ * was decoded and continues with the worker's stream where it stopped.
+ */
+void
+prefetch_start(char **list, long count)
+	{
+		struct prefetch	*p;
+		int				 i;
+
+		npf = (jobs > MAXJOBS) ? MAXJOBS : jobs;
+		if (list != NULL && npf > count)
+			npf = (int)count;
+
+		pfbufsiz = PREFETCHMEM / npf;
+		pflist = list;
+		pfcount = (list != NULL) ? count : LONG_MAX;
+		pfhead = 0;
+
+		if ((pftab = calloc(npf, sizeof(*pftab))) == NULL)
+		{
+			npf = 0;
+			return;
+		}
+
+		for (i = 0 ; i < npf ; ++i)
+		{
+			p = &pftab[i];
+			p->state = (list != NULL) ? PF_RUN : PF_WAIT;
+			p->name = (list != NULL) ? list[i] : NULL;
+			pthread_mutex_init(&p->lock, NULL);
+			pthread_cond_init(&p->cond, NULL);
+
+			if ((p->ibuf = malloc(IBUFSIZ)) == NULL ||
+				(p->buf = malloc(pfbufsiz)) == NULL ||
+				pthread_create(&p->thread, NULL, prefetch_worker, p) != 0)
+			{
+				free(p->ibuf);
+				free(p->buf);
+				npf = i;
+				break;
+			}
+		}
+
+		if (npf == 0)
+		{
+			free(pftab);
+			pftab = NULL;
+		}
+
+		/* The names are read once the number of slots is known */
+		for (i = 0 ; list == NULL && i < npf ; ++i)
+		{
+			if ((pfring[i] = list_read()) == NULL)
+			{
+				pfcount = i;
+				break;
+			}
+
+			p = &pftab[i];
+			pthread_mutex_lock(&p->lock);
+			p->name = pfring[i];
+			p->state = PF_RUN;
+			pthread_cond_signal(&p->cond);
+			pthread_mutex_unlock(&p->lock);
+		}
+	}
+
+void *
+prefetch_worker(void *arg)
+	{
+		struct prefetch	*p = arg;
+
+		pthread_mutex_lock(&p->lock);
+
+		for (;;)
+		{
+			while (p->state != PF_RUN && !p->stop)
+				pthread_cond_wait(&p->cond, &p->lock);
+
+			if (p->stop)
+				break;
+
+			pthread_mutex_unlock(&p->lock);
+			prefetch_file(p);
+			pthread_mutex_lock(&p->lock);
+
+			p->state = PF_READY;
+			pthread_cond_signal(&p->cond);
+		}
+
+		pthread_mutex_unlock(&p->lock);
+		return NULL;
+	}
+
+/*
+ * Decode as much of one file as fits in the slot buffer.  Opening the file
+ * follows comprexx() closely enough to find the same file in the common
+ * cases; when it does not, the slot is simply not used.
+ */
+void
+prefetch_file(struct prefetch *p)
+	{
+		struct stat		 st;
+		char			*zname = NULL;
+		size_t			 namesize = strlen(p->name);
+		size_t			 ilen;
+		size_t			 olen;
+		ssize_t			 rsize;
+		const char_type	*ip;
+		int				 fd;
+
+		p->valid = 0;
+		p->offset = 0;
+		p->ret = LZW_OK;
+		p->err = 0;
+		p->len = 0;
+
+		if ((fd = open(p->name, O_RDONLY|O_BINARY)) == -1)
+		{
+			if (errno != ENOENT ||
+				(namesize >= 2 && strcmp(&p->name[namesize - 2], ".Z") == 0) ||
+				(zname = malloc(namesize + 3)) == NULL)
+				return;
+
+			memcpy(zname, p->name, namesize);
+			strcpy(&zname[namesize], ".Z");
+			fd = open(zname, O_RDONLY|O_BINARY);
+			free(zname);
+
+			if (fd == -1)
+				return;
+		}
+
+		if (fstat(fd, &st) == -1 || (st.st_mode & S_IFMT) != S_IFREG ||
+			lzw_init(&p->z, 0, maxdbits) != LZW_OK)
+		{
+			close(fd);
+			return;
+		}
+
+		p->dev = st.st_dev;
+		p->ino = st.st_ino;
+		p->valid = 1;
+
+		while ((rsize = read(fd, p->ibuf, IBUFSIZ)) > 0)
+		{
+			ip = p->ibuf;
+
+			do
+			{
+				ilen = rsize;
+				olen = pfbufsiz - p->len;
+				p->ret = lzw_decode(&p->z, ip, &ilen, p->buf + p->len, &olen);
+				p->len += olen;
+				p->offset += ilen;
+
+				if (p->ret != LZW_OK || p->len == pfbufsiz)
+					goto out;
+
+				ip += ilen;
+				rsize -= ilen;
+			}
+			while (rsize > 0);
+		}
+
+		if (rsize < 0)
+			p->err = errno;
+
+out:
+		close(fd);
+	}
+
+/*
+ * Called by decompress(): if the worker of the current file decoded fdin,
+ * write its output and return its stream, positioned for the rest of the
+ * file.  *ret gets the result of the worker's last lzw_decode().
+ */
+struct lzw_stream *
+prefetch_take(int fdin, int fdout, int *ret)
+	{
+		struct prefetch	*p;
+		struct stat		 st;
+
+		if (npf == 0 || pfhead >= pfcount)
+			return NULL;
+
+		p = &pftab[pfhead % npf];
+
+		pthread_mutex_lock(&p->lock);
+		while (p->state == PF_RUN)
+			pthread_cond_wait(&p->cond, &p->lock);
+		pthread_mutex_unlock(&p->lock);
+
+		if (!p->valid || fstat(fdin, &st) == -1 ||
+			st.st_dev != p->dev || st.st_ino != p->ino)
+			return NULL;
+
+		p->valid = 0;		/* Once only; -r may visit a file twice */
+
+		if (p->len > 0 && write(fdout, p->buf, p->len) != (ssize_t)p->len)
+			write_error();
+
+		if (p->err != 0)
+		{
+			errno = p->err;
+			read_error();
+		}
+
+		if (lseek(fdin, p->offset, SEEK_SET) == -1)
+			read_error();
+
+		*ret = p->ret;
+		return &p->z;
+	}
+
+/*
+ * The main thread is done with the current file; give its slot the file
+ * npf places further on.
+ */
+void
+prefetch_next(void)
+	{
+		struct prefetch	*p;
+
+		if (npf == 0 || pfhead >= pfcount)
+			return;
+
+		p = &pftab[pfhead % npf];
+
+		pthread_mutex_lock(&p->lock);
+		while (p->state == PF_RUN)
+			pthread_cond_wait(&p->cond, &p->lock);
+
+		if (pflist == NULL && pfhead + npf < pfcount)
+		{/* Its name takes the place of the one before the current file */
+			free(pfring[(pfhead + npf) % (npf + 1)]);
+			if ((pfring[(pfhead + npf) % (npf + 1)] = list_read()) == NULL)
+				pfcount = pfhead + npf;
+		}
+
+		if (pfhead + npf < pfcount)
+		{
+			p->name = prefetch_name(pfhead + npf);
+			p->state = PF_RUN;
+		}
+		else
+			p->state = PF_WAIT;
+
+		pthread_cond_signal(&p->cond);
+		pthread_mutex_unlock(&p->lock);
+
+		++pfhead;
+	}
+
+void
+prefetch_stop(void)
+	{
+		struct prefetch	*p;
+		int				 i;
+
+		for (i = 0 ; i < npf ; ++i)
+		{
+			p = &pftab[i];
+
+			pthread_mutex_lock(&p->lock);
+			p->stop = 1;
+			pthread_cond_signal(&p->cond);
+			pthread_mutex_unlock(&p->lock);
+
+			pthread_join(p->thread, NULL);
+			pthread_mutex_destroy(&p->lock);
+			pthread_cond_destroy(&p->cond);
+			lzw_free(&p->z);
+			free(p->ibuf);
+			free(p->buf);
+		}
+
+		for (i = 0 ; i <= MAXJOBS ; ++i)
+		{
+			free(pfring[i]);
+			pfring[i] = NULL;
+		}
+
+		free(pftab);
+		pftab = NULL;
+		npf = 0;
+	}
+
+/*
+ * Name of file i; with --files-from only the files from pfhead on.
+ */
+const char *
+prefetch_name(long i)
+	{
+		if (i >= pfcount)
+			return NULL;
+
+		return (pflist != NULL) ? pflist[i] : pfring[i % (npf + 1)];
+	}
+
+/*
+ * uncompress -j of an extended file with an index: up to jobs threads,
+ * this one included, uncompress a segment each at a time and write it in
+ * place with pwrite().  Returns the first error; errno is that of a read
+ * or write error.
+ */
+int
+segment_decode(int fdin, int fdout, const struct lzw_index *ix)
+	{
+		struct segjob	j;
+		pthread_t		thread[MAXJOBS];
+		long			n;
+		long			i;
+
+		memset(&j, 0, sizeof(j));
+		pthread_mutex_init(&j.lock, NULL);
+		j.fdin = fdin;
+		j.fdout = fdout;
+		j.ix = ix;
+		j.ret = LZW_OK;
+
+		n = (jobs > MAXJOBS) ? MAXJOBS : jobs;
+		if (n > ix->nseg)
+			n = ix->nseg;
+
+		for (i = 1 ; i < n ; ++i)
+			if (pthread_create(&thread[i-1], NULL, segment_worker, &j) != 0)
+				break;
+
+		n = i;
+		segment_worker(&j);
+
+		for (i = 1 ; i < n ; ++i)
+			pthread_join(thread[i-1], NULL);
+
+		pthread_mutex_destroy(&j.lock);
+		errno = j.err;
+		return j.ret;
+	}
+
+void *
+segment_worker(void *arg)
+	{
+		struct segjob		*j = arg;
+		struct lzw_stream	 z;
+		char_type			*ibuf = malloc(IBUFSIZ);
+		char_type			*obuf = malloc(BIGOBUFSIZ);
+		long				 i;
+		int					 ret = (ibuf != NULL && obuf != NULL) ? LZW_OK : LZW_ENOMEM;
+		int					 err = 0;
+
+		memset(&z, 0, sizeof(z));
+
+		while (ret == LZW_OK)
+		{
+			pthread_mutex_lock(&j->lock);
+			i = (j->ret == LZW_OK && j->next < j->ix->nseg) ? j->next++ : -1;
+			pthread_mutex_unlock(&j->lock);
+
+			if (i < 0)
+				break;
+
+			ret = segment_one(j, i, &z, ibuf, obuf);
+			err = errno;
+		}
+
+		pthread_mutex_lock(&j->lock);
+		if (ret != LZW_OK && j->ret == LZW_OK)
+		{
+			j->ret = ret;
+			j->err = err;
+		}
+		pthread_mutex_unlock(&j->lock);
+
+		lzw_free(&z);
+		free(ibuf);
+		free(obuf);
+		return NULL;
+	}
+
+/*
+ * Uncompress segment i.  The codes of a segment start after a CLEAR, so
+ * with the header of an ordinary file in front a fresh stream decodes them.
+ */
+int
+segment_one(struct segjob *j, long i, struct lzw_stream *z, char_type *ibuf,
+			char_type *obuf)
+	{
+		const struct lzw_index	*ix = j->ix;
+		const struct lzw_seg	*sg = &ix->seg[i];
+		long					 cpos = sg->coff;
+		long					 cend = (i+1 < ix->nseg) ? sg[1].coff : ix->tstart;
+		long					 upos = sg->uoff;
+		long					 uend = (i+1 < ix->nseg) ? sg[1].uoff : ix->usize;
+		uint32_t				 sum = 1;
+		const char_type			*ip;
+		size_t					 ilen;
+		size_t					 olen;
+		ssize_t					 rsize;
+		int						 ret;
+
+		if (lzw_init(z, 0, maxdbits) != LZW_OK)
+			return LZW_ENOMEM;
+
+		ibuf[0] = MAGIC_1;
+		ibuf[1] = MAGIC_2;
+		ibuf[2] = (char_type)(ix->maxbits | BLOCK_MODE);
+		ilen = 3;
+
+		do
+		{
+			if (cpos < cend)
+			{
+				if ((rsize = pread(j->fdin, ibuf + ilen, min(IBUFSIZ - ilen, (size_t)(cend - cpos)),
+								   cpos)) <= 0)
+					return (rsize == 0) ? LZW_ECORRUPT : LZW_EREAD;
+
+				cpos += rsize;
+				ilen += rsize;
+			}
+
+			ip = ibuf;
+
+			do
+			{
+				size_t n = ilen;
+
+				olen = BIGOBUFSIZ;
+				if ((ret = lzw_decode(z, ip, &n, obuf, &olen)) != LZW_OK)
+					return ret;
+
+				if ((long)olen > uend - upos)
+					return LZW_ECORRUPT;
+
+				if (olen > 0 && pwrite(j->fdout, obuf, olen, upos) != (ssize_t)olen)
+					return LZW_EWRITE;
+
+				sum = adler32(sum, obuf, olen);
+				upos += olen;
+				ip += n;
+				ilen -= n;
+			}
+			while (ilen > 0 || olen == BIGOBUFSIZ);
+		}
+		while (cpos < cend);
+
+		return (upos == uend && sum == sg->sum) ? LZW_OK : LZW_ECORRUPT;
+	}
+#endif
+
+#ifdef DAEMON
+/*
+ * --daemon: serve compress and uncompress requests on a Unix socket, so
+ * that callers pay for neither a fork and exec nor setting up the tables.
+ * Every thread (-j of them) accepts connections on its own and keeps its
+ * stream and buffers from one request to the next.
+ */
+void
+daemon_run(const char *path)
+	{
+		struct sockaddr_un	 addr;
+		struct stat			 st;
+		struct daemon_ctx	*tab;
+		int					 sock;
+		int					 n = 1;
+		int					 i;
+
+		if (strlen(path) >= sizeof(addr.sun_path))
+		{
+			fprintf(stderr, "%s: socket name too long\n", path);
+			exit(1);
+		}
+
+		memset(&addr, 0, sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		strcpy(addr.sun_path, path);
+
+		/* A socket left behind by an earlier daemon */
+		if (lstat(path, &st) == 0 && (st.st_mode & S_IFMT) == S_IFSOCK)
+			unlink(path);
+
+		if ((sock = socket(AF_UNIX, SOCK_STREAM, 0)) == -1 ||
+			bind(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+			listen(sock, 64) == -1)
+		{
+			perror(path);
+			exit(1);
+		}
+
+		/* abort_compress() removes the socket when we are killed */
+		ofname = (char *)path;
+		remove_ofname = 1;
+
+		/* A client going away must not take the daemon with it */
+		signal(SIGPIPE, SIG_IGN);
+
+#ifdef PTHREADS
+		if (jobs > 1)
+			n = (jobs > MAXJOBS) ? MAXJOBS : jobs;
+#endif
+
+		if ((tab = calloc(n, sizeof(*tab))) == NULL)
+		{
+			fprintf(stderr, "Cannot allocate memory for the daemon.\n");
+			abort_compress();
+		}
+
+		for (i = 0 ; i < n ; ++i)
+		{
+			tab[i].sock = sock;
+
+			if ((tab[i].ibuf = malloc(IBUFSIZ)) == NULL ||
+				(tab[i].obuf = malloc(OBUFSIZ)) == NULL)
+			{
+				fprintf(stderr, "Cannot allocate memory for the daemon.\n");
+				abort_compress();
+			}
+
+#ifdef PTHREADS
+			if (i > 0)
+			{
+				pthread_t	thread;
+
+				if (pthread_create(&thread, NULL, daemon_worker, &tab[i]) != 0)
+					break;
+			}
+#endif
+		}
+
+		daemon_worker(&tab[0]);
+	}
+
+void *
+daemon_worker(void *arg)
+	{
+		struct daemon_ctx	*d = arg;
+		int					 conn;
+
+		for (;;)
+		{
+			if ((conn = accept(d->sock, NULL, NULL)) == -1)
+			{
+				if (errno == EINTR || errno == ECONNABORTED)
+					continue;
 
-						disp = (HSIZE - hp)-1;	/* secondary hash (after G. Knott) */
+				perror("accept");
+				abort_compress();
+			}
 
-						do
-						{
-							if ((hp -= disp) < 0)	hp += HSIZE;
+			daemon_serve(d, conn);
+			close(conn);
+		}
 
-							if ((i = htab[hp]) == fc)
-								goto hfound;
-						}
-						while (i != -1);
-					}
-				}
-#else
-				{
-					long i;
-					long p;
-					fc = fcode.code;
-					hp = ((((long)(fcode.e.c)) << (HBITS-8)) ^ (long)(fcode.e.ent));
-
-					if ((i = htab[hp]) == fc)	goto hfound;
-					if (i == -1)				goto out;
-
-					p = primetab[fcode.e.c];
-lookup:				hp = (hp+p)&HMASK;
-					if ((i = htab[hp]) == fc)	goto hfound;
-					if (i == -1)				goto out;
-					hp = (hp+p)&HMASK;
-					if ((i = htab[hp]) == fc)	goto hfound;
-					if (i == -1)				goto out;
-					hp = (hp+p)&HMASK;
-					if ((i = htab[hp]) == fc)	goto hfound;
-					if (i == -1)				goto out;
-					goto lookup;
-				}
-out:			;
-#endif
-				output(outbuf,outbits,fcode.e.ent,n_bits);
+		return NULL;
+	}
 
-				{
-					long fc = fcode.code;
-					fcode.e.ent = fcode.e.c;
+/*
+ * Read one request from conn and carry it out.  Anything that does not
+ * look like a request simply gets the connection closed.
+ */
+void
+daemon_serve(struct daemon_ctx *d, int conn)
+	{
+		struct daemon_req	 req;
+		struct daemon_rep	 rep;
+		struct msghdr		 msg;
+		struct iovec		 iov;
+		struct cmsghdr		*cm;
+		union
+			{
+				struct cmsghdr	hdr;
+				char			buf[CMSG_SPACE(2*sizeof(int))];
+			}				 ctl;
+		int					 fd[2];
+		int					 nfd = 0;
+		int					 nset = 0;	/* SCM_RIGHTS messages received		*/
+		int					 xfd;		/* One of them beyond the first set	*/
+		int					 k;
+		int					 i;
+		size_t				 got = 0;
+		ssize_t				 n;
+
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
 
-					if (stcode)
-					{
-						codetab[hp] = (unsigned short)free_ent++;
-						htab[hp] = fc;
-					}
-				} 
+		do
+		{/* The descriptors come with the first byte */
+			iov.iov_base = (char *)&req + got;
+			iov.iov_len = sizeof(req) - got;
+			msg.msg_control = ctl.buf;
+			msg.msg_controllen = sizeof(ctl.buf);
 
-				goto next;
+			if ((n = recvmsg(conn, &msg, 0)) <= 0)
+				break;
+			got += n;
 
-endlop:			if (fcode.e.ent >= FIRST && rpos < rsize)
-					goto next2;
+			if (msg.msg_flags & MSG_CTRUNC)
+				++nset;		/* Some were dropped: refuse the request */
 
-				if (rpos > rlop)
+			for (cm = CMSG_FIRSTHDR(&msg) ; cm != NULL ; cm = CMSG_NXTHDR(&msg, cm))
+				if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_RIGHTS)
 				{
-					bytes_in += rpos-rlop;
-					rlop = rpos;
+					k = (int)((cm->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+					if (nset++ == 0 && k <= 2)
+					{
+						nfd = k;
+						memcpy(fd, CMSG_DATA(cm), nfd*sizeof(int));
+						continue;
+					}
+
+					/* Only one set per request: close the others */
+					for (i = 0 ; i < k ; ++i)
+					{
+						memcpy(&xfd, CMSG_DATA(cm) + i*sizeof(int), sizeof(int));
+						close(xfd);
+					}
 				}
-			}
-			while (rlop < rsize);
 		}
+		while (got < sizeof(req));
 
-		if (rsize < 0)
-			read_error();
-
-		if (bytes_in > 0)
-			output(outbuf,outbits,fcode.e.ent,n_bits);
+		if (got < sizeof(req) || memcmp(req.magic, DAEMON_MAGIC, 4) != 0 ||
+			req.op < DOP_COMPRESS || req.op > DOP_TEST || nfd == 1 || nset > 1)
+		{
+			while (nfd > 0)
+				close(fd[--nfd]);
+			return;
+		}
 
-		if (write(fdout, outbuf, (outbits+7)>>3) != (outbits+7)>>3)
-			write_error();
+		if (nfd == 0)
+			fd[0] = fd[1] = conn;
 
-		bytes_out += (outbits+7)>>3;
+		daemon_code(d, &req, fd[0], fd[1], &rep);
 
-		return;
+		if (nfd == 2)
+		{
+			close(fd[0]);
+			close(fd[1]);
+			send(conn, &rep, sizeof(rep), MSG_NOSIGNAL);
+		}
 	}
 
 /*
- * Decompress stdin to stdout.  This routine adapts to the codes in the
- * file building the "string" table on-the-fly; requiring no table to
- * be stored in the compressed file.  The tables used herein are shared
- * with those of the compress() routine.  See the definitions above.
+ * The loops of compress() and decompress(), reporting errors in rep
+ * instead of exiting.
  */
-
 void
-decompress(int fdin, int fdout)
+daemon_code(struct daemon_ctx *d, struct daemon_req *req, int fdin, int fdout,
+			struct daemon_rep *rep)
 	{
-		char_type *stackp;
-		code_int code;
-		int finchar;
-		code_int oldcode;
-		code_int incode;
-		int inbits;
-		int posbits;
-		int outpos;
-		int insize;
-		int bitmask;
-		code_int free_ent;
-		code_int maxcode;
-		code_int maxmaxcode;
-		int n_bits;
-		int rsize;
-		int block_mode;
+		struct lzw_stream	*z = &d->z;
+		int					 encode = (req->op == DOP_COMPRESS);
+		int					 bits = req->bits;
+		int					 finish = 0;
+		int					 ret;
+		ssize_t				 rsize = 0;
+		size_t				 ilen;
+		size_t				 olen;
+		const char_type		*ip = d->ibuf;
 
-		bytes_in = 0;
-		bytes_out = 0;
-		insize = 0;
+		memset(rep, 0, sizeof(*rep));
+
+		if (bits < INIT_BITS)
+			bits = INIT_BITS;
+		if (bits > (encode ? maxbits : maxdbits))
+			bits = encode ? maxbits : maxdbits;
+
+		if ((ret = lzw_init(z, encode, bits)) != LZW_OK)
+			goto out;
 
-		while (insize < 3 && (rsize = read(fdin, inbuf+insize, IBUFSIZ)) > 0)
-			insize += rsize;
+		z->test = (req->op == DOP_TEST);
 
-		if (insize < 3 || inbuf[0] != MAGIC_1 || inbuf[1] != MAGIC_2)
+		for (;;)
 		{
-			if (rsize < 0)
-				read_error();
+			do
+			{
+				ilen = rsize;
+				olen = OBUFSIZ;
+
+				if (encode)
+					ret = lzw_encode(z, ip, &ilen, d->obuf, &olen, finish);
+				else
+					ret = lzw_decode(z, ip, &ilen, d->obuf, &olen);
+
+				if (olen > 0 && req->op != DOP_TEST &&
+					full_write(fdout, d->obuf, olen) == -1)
+				{
+					ret = LZW_EWRITE;
+					rep->err = errno;
+				}
+
+				if (ret != LZW_OK)
+					goto out;
+
+				ip += ilen;
+				rsize -= ilen;
+			}
+			while (rsize > 0 || olen == OBUFSIZ || (encode && finish));
+
+			if (finish)
+				break;
 
-			if (insize > 0)
+			if ((rsize = read(fdin, d->ibuf, IBUFSIZ)) < 0)
 			{
-				fprintf(stderr, "%s: not in compressed format\n",
-									(ifname[0] != '\0'? ifname : "stdin"));
-				exit_code = 1;
+				ret = LZW_EREAD;
+				rep->err = errno;
+				goto out;
 			}
 
-			return ;
+			finish = (rsize == 0);
+			ip = d->ibuf;
 		}
 
-		maxbits = inbuf[2] & BIT_MASK;
-		block_mode = inbuf[2] & BLOCK_MODE;
+		if (!encode && z->nhdr < z->hdrlen && z->bytes_in > 0)
+			ret = LZW_EMAGIC;
+		else if (!encode && z->nhdr == z->hdrlen)
+			ret = lzw_decode_end(z);
+
+out:
+		rep->ret = (ret == LZW_END) ? LZW_OK : ret;
+		rep->maxbits = z->maxbits;
+		rep->bytes_in = z->bytes_in;
+		rep->bytes_out = z->bytes_out;
+	}
 
-		if (maxbits > BITS)
+/*
+ * --client: have the daemon on client_path code fdin to fdout.  Returns
+ * -1 if there is no daemon to be reached, after which the work is done
+ * here.  Read and write errors of the daemon are ours.
+ */
+int
+daemon_call(int op, int bits, int fdin, int fdout, struct daemon_rep *rep)
+	{
+		struct sockaddr_un	 addr;
+		struct daemon_req	 req;
+		struct msghdr		 msg;
+		struct iovec		 iov;
+		struct cmsghdr		*cm;
+		union
+			{
+				struct cmsghdr	hdr;
+				char			buf[CMSG_SPACE(2*sizeof(int))];
+			}				 ctl;
+		int					 fd[2];
+		int					 sock;
+		size_t				 got = 0;
+		ssize_t				 n;
+
+		memset(&addr, 0, sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		strncpy(addr.sun_path, client_path, sizeof(addr.sun_path) - 1);
+
+		if ((sock = socket(AF_UNIX, SOCK_STREAM, 0)) == -1 ||
+			connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1)
 		{
-			fprintf(stderr,
-					"%s: compressed with %d bits, can only handle %d bits\n",
-					(*ifname != '\0' ? ifname : "stdin"), maxbits, BITS);
-			exit_code = 4;
-			return;
+			if (!silent)
+				fprintf(stderr, "%s: %s: %s; working without the daemon\n",
+						progname, client_path, strerror(errno));
+			if (sock != -1)
+				close(sock);
+			client_path = NULL;
+			return -1;
 		}
 
-		maxmaxcode = MAXCODE(maxbits);
+		memset(&req, 0, sizeof(req));
+		memcpy(req.magic, DAEMON_MAGIC, 4);
+		req.op = op;
+		req.bits = bits;
+
+		iov.iov_base = &req;
+		iov.iov_len = sizeof(req);
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = ctl.buf;
+		msg.msg_controllen = sizeof(ctl.buf);
+
+		fd[0] = fdin;
+		fd[1] = fdout;
+		cm = CMSG_FIRSTHDR(&msg);
+		cm->cmsg_level = SOL_SOCKET;
+		cm->cmsg_type = SCM_RIGHTS;
+		cm->cmsg_len = CMSG_LEN(sizeof(fd));
+		memcpy(CMSG_DATA(cm), fd, sizeof(fd));
+
+		if (sendmsg(sock, &msg, MSG_NOSIGNAL) != sizeof(req))
+			got = 0;
+		else
+			while (got < sizeof(*rep) &&
+				   (n = read(sock, (char *)rep + got, sizeof(*rep) - got)) > 0)
+				got += n;
 
-		bytes_in = insize;
-		reset_n_bits_for_decompressor(n_bits, bitmask, maxbits, maxcode, maxmaxcode);
-		oldcode = -1;
-		finchar = 0;
-		outpos = 0;
-		posbits = 3<<3;
+		close(sock);
 
-	    free_ent = ((block_mode) ? FIRST : 256);
+		if (got < sizeof(*rep))
+		{
+			fprintf(stderr, "%s: %s: no reply from the daemon\n", progname, client_path);
+			abort_compress();
+		}
 
-		clear_tab_prefixof();	/* As above, initialize the first
-								   256 entries in the table. */
+		errno = rep->err;
+		if (rep->ret == LZW_EREAD)
+			read_error();
+		if (rep->ret == LZW_EWRITE)
+			write_error();
 
-	    for (code = 255 ; code >= 0 ; --code)
-			tab_suffixof(code) = (char_type)code;
+		return 0;
+	}
 
-		do
+int
+full_write(int fd, const void *buf, size_t len)
+	{
+		const char	*p = buf;
+		ssize_t		 n;
+
+		while (len > 0)
 		{
-resetbuf:	;
+			if ((n = write(fd, p, len)) == -1)
 			{
-				int i;
-				int e;
-				int o;
-
-				o = posbits >> 3;
-				e = o <= insize ? insize - o : 0;
+				if (errno == EINTR)
+					continue;
+				return -1;
+			}
 
-				for (i = 0 ; i < e ; ++i)
-					inbuf[i] = inbuf[i+o];
+			p += n;
+			len -= n;
+		}
 
-				insize = e;
-				posbits = 0;
-			}
+		return 0;
+	}
+#endif
 
-			if (insize < sizeof(inbuf)-IBUFSIZ)
-			{
-				if ((rsize = read(fdin, inbuf+insize, IBUFSIZ)) < 0)
-					read_error();
+void
+read_error(void)
+	{
+		fprintf(stderr, "\nread error on");
+	    perror((ifname[0] != '\0') ? ifname : "stdin");
+		abort_compress();
+	}
 
-				insize += rsize;
-			}
+void
+write_error(void)
+	{
+		fprintf(stderr, "\nwrite error on");
+	    perror(ofname ? ofname : "stdout");
+		abort_compress();
+	}
 
-			inbits = ((rsize > 0) ? (insize - insize%n_bits)<<3 : 
-									(insize<<3)-(n_bits-1));
+void
+abort_compress(void)
+	{
+		if (remove_ofname && !otmp && !resume_kept)
+	    	unlink(ofname);
 
-			while (inbits > posbits)
-			{
-				if (free_ent > maxcode)
-				{
-					posbits = ((posbits-1) + ((n_bits<<3) -
-									 (posbits-1+(n_bits<<3))%(n_bits<<3)));
+		exit(1);
+	}
 
-					++n_bits;
-					if (n_bits == maxbits)
-						maxcode = maxmaxcode;
-					else
-					    maxcode = MAXCODE(n_bits)-1;
+/*
+ * --profile: split the time and, where perf_event_open(2) allows it, the
+ * hardware counters of the run over the phases of compress() and
+ * decompress().  Without counters only the time is measured.
+ */
+#ifdef PERF_EVENTS
+int
+perf_open(uint64_t config, int group, int exclude_kernel)
+	{
+		struct perf_event_attr	pe;
+
+		memset(&pe, 0, sizeof(pe));
+		pe.type = PERF_TYPE_HARDWARE;
+		pe.size = sizeof(pe);
+		pe.config = config;
+		pe.disabled = (group == -1);
+		pe.exclude_kernel = exclude_kernel;
+		pe.exclude_hv = 1;
+		pe.read_format = PERF_FORMAT_GROUP;
+
+		return (int)syscall(SYS_perf_event_open, &pe, 0, -1, group, 0);
+	}
+#endif
 
-					bitmask = (1<<n_bits)-1;
-					goto resetbuf;
-				}
+void
+prof_start(void)
+	{
+		int		i;
+#ifdef PERF_EVENTS
+		static const uint64_t config[NCOUNTERS] = {
+			PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+			PERF_COUNT_HW_BRANCH_MISSES, PERF_COUNT_HW_CACHE_MISSES };
+		int		exclude_kernel;
+		int		n = 0;
+		int		fd;
+#endif
 
-				input(inbuf,posbits,code,n_bits,bitmask);
+		for (i = 0 ; i < NCOUNTERS ; ++i)
+			prof_index[i] = -1;
 
-				if (oldcode == -1)
-				{
-					if (code >= 256) {
-						fprintf(stderr, "oldcode:-1 code:%i\n", (int)(code));
-						fprintf(stderr, "uncompress: corrupt input\n");
-						abort_compress();
-					}
-					outbuf[outpos++] = (char_type)(finchar = (int)(oldcode = code));
-					continue;
-				}
+#ifdef PERF_EVENTS
+		/* Count the kernel side of I/O too if we may, else user space only */
+		for (exclude_kernel = 0 ; exclude_kernel <= 1 ; ++exclude_kernel)
+			if ((prof_fd = perf_open(config[0], -1, exclude_kernel)) != -1)
+				break;
 
-				if (code == CLEAR && block_mode)
-				{
-					clear_tab_prefixof();
-	    			free_ent = FIRST - 1;
-					posbits = ((posbits-1) + ((n_bits<<3) -
-								(posbits-1+(n_bits<<3))%(n_bits<<3)));
-					reset_n_bits_for_decompressor(n_bits, bitmask, maxbits, maxcode, maxmaxcode);
-					goto resetbuf;
-				}
+		if (prof_fd == -1)
+			fprintf(stderr, "%s: no hardware counters (%s), timing only\n",
+							progname, strerror(errno));
+		else
+		{
+			prof_index[0] = n++;
 
-				incode = code;
-			    stackp = de_stack;
+			for (i = 1 ; i < NCOUNTERS ; ++i)
+				if ((fd = perf_open(config[i], prof_fd, exclude_kernel)) != -1)
+					prof_index[i] = n++;
 
-				if (code >= free_ent)	/* Special case for KwKwK string.	*/
-				{
-					if (code > free_ent)
-					{
-						char_type *p;
+			ioctl(prof_fd, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+			ioctl(prof_fd, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+		}
+#endif
 
-						posbits -= n_bits;
-						p = &inbuf[posbits>>3];
+		prof_read(prof_last, &prof_last_t);
+	}
 
-						fprintf(stderr, "insize:%d posbits:%d inbuf:%02X %02X %02X %02X %02X (%d)\n", insize, posbits,
-								p[-1],p[0],p[1],p[2],p[3], (posbits&07));
-			    		fprintf(stderr, "uncompress: corrupt input\n");
-						abort_compress();
-					}
+double
+prof_clock(void)
+	{
+#ifdef CLOCK_MONOTONIC
+		struct timespec	ts;
 
-        	    	*--stackp = (char_type)finchar;
-		    		code = oldcode;
-				}
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		return ts.tv_sec + ts.tv_nsec / 1e9;
+#else
+		return (double)clock() / CLOCKS_PER_SEC;
+#endif
+	}
 
-				while ((cmp_code_int)code >= (cmp_code_int)256)
-				{ /* Generate output characters in reverse order */
-			    	*--stackp = tab_suffixof(code);
-			    	code = tab_prefixof(code);
-				}
+/*
+ * --rate-limit: count n bytes read or written against a token bucket that
+ * fills at rate_limit bytes per second up to RATE_BURST seconds' worth, and
+ * sleep off any debt.  The bucket carries over from file to file, so a long
+ * job keeps to the rate as a whole.
+ */
+void
+rate_wait(long n)
+	{
+#ifdef RATELIMIT
+		struct timespec	ts;
+		double			now;
+		double			wait;
 
-				*--stackp =	(char_type)(finchar = tab_suffixof(code));
+		if (rate_limit <= 0)
+			return;
 
-			/* And put them out in forward order */
+		now = prof_clock();
+		if (rate_last == 0 || (rate_tokens += (now - rate_last) * rate_limit) > RATE_BURST * rate_limit)
+			rate_tokens = RATE_BURST * rate_limit;
+		rate_last = now;
 
-				{
-					int i;
+		if ((rate_tokens -= n) < 0)
+		{
+			wait = -rate_tokens / rate_limit;
+			ts.tv_sec = (time_t)wait;
+			ts.tv_nsec = (long)((wait - ts.tv_sec) * 1e9);
+			while (nanosleep(&ts, &ts) == -1 && errno == EINTR)
+				;
+		}
+#endif
+	}
 
-					if (outpos+(i = (de_stack-stackp)) >= OBUFSIZ)
-					{
-						do
-						{
-							if (i > OBUFSIZ-outpos) i = OBUFSIZ-outpos;
+/*
+ * --nocache: a one-pass job over a huge file should not push everything
+ * else out of the page cache.  Input is read ahead CACHE_AHEAD bytes and
+ * dropped a CACHE_STEP at a time once used.  Output is written back a
+ * CACHE_STEP at a time, and each step is dropped once the next one is on
+ * its way, so that the kernel only holds a few steps of either.  Pipes and
+ * other files that cannot seek get no hints.
+ */
+void
+hint_start(struct cache_hint *h, int fd, int out)
+	{
+		h->fd = -1;
+#ifdef NOCACHE
+		if (!nocache_flg || fd == -1 || (h->off = lseek(fd, 0, SEEK_CUR)) == -1)
+			return;
 
-							if (i > 0)
-							{
-								memcpy(outbuf+outpos, stackp, i);
-								outpos += i;
-							}
+		h->fd = fd;
+		h->out = out;
+		h->mark = h->drop = h->off - h->off % CACHE_STEP;
 
-							if (outpos >= OBUFSIZ)
-							{
-								if (write(fdout, outbuf, outpos) != outpos)
-									write_error();
+		if (!out)
+		{
+			posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+			posix_fadvise(fd, h->off, CACHE_AHEAD, POSIX_FADV_WILLNEED);
+		}
+#endif
+	}
 
-								outpos = 0;
-							}
-							stackp+= i;
-						}
-						while ((i = (de_stack-stackp)) > 0);
-					}
-					else
-					{
-						memcpy(outbuf+outpos, stackp, i);
-						outpos += i;
-					}
-				}
+/*
+ * n more bytes of the file of h have been read or written.
+ */
+void
+hint_io(struct cache_hint *h, long n)
+	{
+#ifdef NOCACHE
+		if (h->fd == -1)
+			return;
 
-				if ((code = free_ent) < maxmaxcode) /* Generate the new entry. */
-				{
-			    	tab_prefixof(code) = (unsigned short)oldcode;
-			    	tab_suffixof(code) = (char_type)finchar;
-	    			free_ent = code+1;
-				} 
+		for (h->off += n ; h->off - h->mark >= CACHE_STEP ; h->mark += CACHE_STEP)
+		{
+			if (!h->out)
+			{
+				posix_fadvise(h->fd, h->mark, CACHE_STEP, POSIX_FADV_DONTNEED);
+				posix_fadvise(h->fd, h->mark + CACHE_AHEAD, CACHE_STEP, POSIX_FADV_WILLNEED);
+				continue;
+			}
 
-				oldcode = incode;	/* Remember previous code.	*/
+#ifdef SYNC_FILE_RANGE_WRITE
+			sync_file_range(h->fd, h->mark, CACHE_STEP, SYNC_FILE_RANGE_WRITE);
+#endif
+			if (h->mark > h->drop)
+			{/* Dirty pages cannot be dropped: wait for the step before */
+#ifdef SYNC_FILE_RANGE_WRITE
+				sync_file_range(h->fd, h->drop, h->mark - h->drop, SYNC_FILE_RANGE_WAIT_BEFORE |
+								SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+#endif
+				posix_fadvise(h->fd, h->drop, h->mark - h->drop, POSIX_FADV_DONTNEED);
+				h->drop = h->mark;
 			}
+		}
+#endif
+	}
+
+/*
+ * Done with the file of h: drop the rest.
+ */
+void
+hint_end(struct cache_hint *h)
+	{
+#ifdef NOCACHE
+		if (h->fd == -1)
+			return;
 
-			bytes_in += rsize;
-	    }
-		while (rsize > 0);
+		if (h->out)
+		{
+#ifdef SYNC_FILE_RANGE_WRITE
+			sync_file_range(h->fd, h->drop, 0, SYNC_FILE_RANGE_WAIT_BEFORE |
+							SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+#endif
+			posix_fadvise(h->fd, h->drop, 0, POSIX_FADV_DONTNEED);
+		}
+		else
+			posix_fadvise(h->fd, h->mark, 0, POSIX_FADV_DONTNEED);
 
-		if (outpos > 0 && write(fdout, outbuf, outpos) != outpos)
-			write_error();
+		h->fd = -1;
+#endif
 	}
 
 void
-read_error(void)
+prof_read(uint64_t *val, double *t)
 	{
-		fprintf(stderr, "\nread error on");
-	    perror((ifname[0] != '\0') ? ifname : "stdin");
-		abort_compress();
+#ifdef PERF_EVENTS
+		uint64_t	buf[1+NCOUNTERS];
+		int			i;
+
+		if (prof_fd != -1 && read(prof_fd, buf, sizeof(buf)) > 0)
+			for (i = 0 ; i < NCOUNTERS ; ++i)
+				if (prof_index[i] != -1)
+					val[i] = buf[1+prof_index[i]];
+#endif
+
+		*t = prof_clock();
 	}
 
+/*
+ * Charge everything since the last switch to the current phase and go on
+ * with the given one.
+ */
 void
-write_error(void)
+prof_switch(int phase)
 	{
-		fprintf(stderr, "\nwrite error on");
-	    perror(ofname ? ofname : "stdout");
-		abort_compress();
+		uint64_t	val[NCOUNTERS];
+		double		t;
+		int			i;
+
+		if (phase == prof_phase)
+			return;
+
+		memcpy(val, prof_last, sizeof(val));
+		prof_read(val, &t);
+
+		if (prof_phase != PROF_NONE)
+		{
+			for (i = 0 ; i < NCOUNTERS ; ++i)
+				prof_count[prof_phase][i] += val[i] - prof_last[i];
+
+			prof_time[prof_phase] += t - prof_last_t;
+		}
+
+		memcpy(prof_last, val, sizeof(val));
+		prof_last_t = t;
+		prof_phase = phase;
 	}
 
+/*
+ * End of a file: stop measuring and add up its input and codes.
+ */
 void
-abort_compress(void)
+prof_end(struct lzw_stream *z)
 	{
-		if (remove_ofname)
-	    	unlink(ofname);
+		if (!profile || prof_phase == PROF_NONE)
+			return;
 
-		exit(1);
+		prof_switch(PROF_NONE);
+		prof_bytes += z->bytes_in;
+		prof_codes += z->codes;
+	}
+
+void
+prof_report(void)
+	{
+		static const char *phases[NPHASES] = { "setup", "compute", "I/O" };
+		static const char *counters[NCOUNTERS] = {
+			"cycles", "instructions", "branch-misses", "LLC-misses" };
+		uint64_t	total[NCOUNTERS];
+		double		ttotal = 0;
+		int			p;
+		int			i;
+
+		memset(total, 0, sizeof(total));
+
+		fprintf(stderr, "Profile:  %12s", "seconds");
+		for (i = 0 ; i < NCOUNTERS ; ++i)
+			if (prof_index[i] != -1)
+				fprintf(stderr, " %14s", counters[i]);
+		fprintf(stderr, "\n");
+
+		for (p = 0 ; p < NPHASES ; ++p)
+		{
+			fprintf(stderr, "  %-7s %12.6f", phases[p], prof_time[p]);
+			ttotal += prof_time[p];
+
+			for (i = 0 ; i < NCOUNTERS ; ++i)
+				if (prof_index[i] != -1)
+				{
+					fprintf(stderr, " %14llu", (unsigned long long)prof_count[p][i]);
+					total[i] += prof_count[p][i];
+				}
+
+			fprintf(stderr, "\n");
+		}
+
+		fprintf(stderr, "  %-7s %12.6f", "total", ttotal);
+		for (i = 0 ; i < NCOUNTERS ; ++i)
+			if (prof_index[i] != -1)
+				fprintf(stderr, " %14llu", (unsigned long long)total[i]);
+		fprintf(stderr, "\n");
+
+		fprintf(stderr, "  %ld bytes in, %ld codes", prof_bytes, prof_codes);
+
+		if (prof_bytes > 0)
+		{
+			if (prof_index[0] != -1)
+				fprintf(stderr, ", %.2f cycles/byte in compute",
+							(double)prof_count[PROF_COMPUTE][0] / prof_bytes);
+			else
+				fprintf(stderr, ", %.2f ns/byte in compute",
+							prof_time[PROF_COMPUTE] * 1e9 / prof_bytes);
+		}
+
+		if (prof_codes > 0)
+			for (i = 2 ; i < NCOUNTERS ; ++i)
+				if (prof_index[i] != -1)
+					fprintf(stderr, ", %.4f %s/code", (double)total[i] / prof_codes,
+								counters[i]);
+
+		fprintf(stderr, "\n");
 	}
 
 void
@@ -1532,8 +7003,22 @@ about(void)
 #ifdef LSTAT
 		printf("LSTAT, ");
 #endif
-		printf("\n        IBUFSIZ=%d, OBUFSIZ=%d, BITS=%d\n",
-			IBUFSIZ, OBUFSIZ, BITS);
+#ifdef PTHREADS
+		printf("PTHREADS, ");
+#endif
+#ifdef USDT
+		printf("USDT, ");
+#endif
+#ifdef MEMOSIZE
+		printf("MEMOSIZE=%d, ", MEMOSIZE);
+#endif
+		printf("\n        IBUFSIZ=%d, OBUFSIZ=%d, BITS=%d, MAXBITS=%d\n",
+			IBUFSIZ, OBUFSIZ, BITS, MAXBITS);
+		printf("Tables:\n        compress %d bits: %ld bytes, uncompress up to %d bits: %ld bytes",
+			maxbits, lzw_memory(1, maxbits), maxdbits, lzw_memory(0, maxdbits));
+		if (memlimit > 0)
+			printf(" (-M %ld)", memlimit);
+		printf("\n");
 
 		printf("\n\
 Author version 5.x (Modernization):\n\
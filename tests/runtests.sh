@@ -101,6 +101,12 @@ uncompress input.Z
 : "### Check uncompressing non-.Z file fails"
 if uncompress input; then false; fi
 
+: "### Check uncompressing a bad .Z file keeps it"
+echo hello >bad.Z
+if uncompress bad.Z; then false; fi
+[ -e bad.Z ] && [ ! -e bad ]
+rm bad.Z
+
 : "### Check empty directory compression"
 if compress emptydir; then false; fi
 if compress -r emptydir; then false; fi
@@ -179,4 +185,225 @@ compress -b 9 <$COMPRESS >input.Z
 uncompress -c input.Z >input.new
 cmp $COMPRESS input.new
 
+: "### Check compare mode"
+compress --cmp $COMPRESS input.Z
+compress -c input.new >input.new.Z
+compress --cmp input.new
+compress --cmp input.Z input.new.Z
+echo x >>input.new
+if compress --cmp input.Z input.new; then false; fi
+if compress --cmp input.new input.new.Z 2>/dev/null; then false; fi
+rm input.new.Z
+
+: "### Check zcat jobs"
+cp input.Z i.Z
+compress -c -d -j 3 input.Z i.Z input.Z >input.new
+(cat $COMPRESS $COMPRESS $COMPRESS) | cmp - input.new
+rm i.Z
+
+: "### Check test mode"
+compress -t input.Z
+printf 'junk' >i.Z
+if compress -t i.Z input.Z; then false; fi
+mkdir tdir
+cp input.Z tdir/
+cp $COMPRESS tdir/plain
+compress -t -r tdir
+cp i.Z tdir/
+if compress -t -r tdir; then false; fi
+rm -r tdir i.Z
+
+: "### Check early bail-out on incompressible input"
+head -c 1200000 /dev/urandom >rand
+if compress --sample rand; then false; fi
+[ -e rand ] && [ ! -e rand.Z ]
+if compress --cutoff rand; then false; fi
+[ -e rand ] && [ ! -e rand.Z ]
+compress -f --sample --cutoff rand
+uncompress rand.Z
+cp $COMPRESS input.new
+compress --sample --cutoff input.new
+uncompress -c input.new.Z | cmp - $COMPRESS
+rm rand input.new.Z
+
+: "### Check profile output"
+compress --profile -c input >/dev/null 2>input.new
+grep -q "compute" input.new
+
+: "### Check memory limit"
+# The table sizes depend on FAST and MAXBITS, so take the width from -V
+compress -M 100k -c $COMPRESS >input.new.Z
+uncompress -M 100k -c input.new.Z | cmp - $COMPRESS
+compress -c $COMPRESS >input.new.Z
+if uncompress -M 100k -c input.new.Z >/dev/null; then false; fi
+if compress -M 1k -c $COMPRESS >/dev/null; then false; fi
+bits=$("${COMPRESS}" -M 100k -V | sed -n 's/.*compress \([0-9]*\) bits.*/\1/p')
+[ "${bits}" -ge 12 ] && [ "${bits}" -le 13 ]
+if compress -M 9000000000G -V >/dev/null 2>&1; then false; fi
+if compress -j 99999999999 -V >/dev/null 2>&1; then false; fi
+rm input.new.Z
+
+: "### Check sparse output"
+(cat input; head -c 100000 /dev/zero; cat input; head -c 9000 /dev/zero) >sparse
+cp sparse sparse.orig
+compress sparse
+uncompress --sparse sparse.Z
+cmp sparse sparse.orig
+rm sparse sparse.orig
+
+: "### Check daemon mode"
+"${COMPRESS}" --daemon="${TMPDIR}/sock" -j 2 &
+daemon=$!
+while [ ! -S sock ]; do sleep 0.1; done
+compress --client="${TMPDIR}/sock" -c $COMPRESS >input.new.Z
+compress -c $COMPRESS | cmp - input.new.Z
+uncompress --client="${TMPDIR}/sock" -c input.new.Z | cmp - $COMPRESS
+if compress -t --client="${TMPDIR}/sock" input; then false; fi
+kill ${daemon}
+wait ${daemon} || :
+[ ! -e sock ]
+rm input.new.Z
+
+: "### Check extended format"
+for i in 1 2 3 4 5 6 7 8 9 10; do cat $COMPRESS; done >ext
+cp ext ext.orig
+compress --index ext
+compress -t ext.Z
+compress -l ext.Z | grep -q " ext$"
+uncompress -k -j 2 ext.Z
+cmp ext ext.orig
+uncompress -c ext.Z | cmp - ext.orig
+head -c 100000 ext.Z >ext2.Z
+if compress -t ext2.Z; then false; fi
+rm ext ext.Z ext2.Z ext.orig
+
+: "### Check codes wider than 16 bits"
+if "${COMPRESS}" -V | grep -Eq "MAXBITS=(1[7-9]|2)"; then
+	compress -b 24 -c $COMPRESS >input.new.Z
+	uncompress -c input.new.Z | cmp - $COMPRESS
+	compress -b 17 -c $COMPRESS >input.new.Z
+	uncompress -c input.new.Z | cmp - $COMPRESS
+	compress -t input.new.Z
+	if uncompress -M 100k -c input.new.Z >/dev/null; then false; fi
+	rm input.new.Z
+fi
+
+: "### Check file lists"
+mkdir list
+for f in a b c; do cp input "list/in ${f}"; done
+find list -type f -print0 | compress -0 --files-from=-
+[ -e "list/in a.Z" ] && [ -e "list/in c.Z" ] && [ ! -e "list/in b" ]
+find list -type f >names
+cat input input input >input.new
+uncompress -c -j 2 --files-from=names | cmp - input.new
+uncompress --files-from=names
+cmp "list/in b" input
+rm -r list names input.new
+
+: "### Check search"
+mkdir grep
+printf 'one\ntwo needle\nthree\n' >grep/a
+cp input grep/b
+compress -f grep/a grep/b
+[ "$("${COMPRESS}" --grep=needle grep/a.Z)" = "grep/a.Z:2:4:two needle" ]
+[ "$("${COMPRESS}" -r -l --grep=needle grep)" = "grep/a.Z" ]
+"${COMPRESS}" --grep=needle <grep/a.Z >/dev/null
+if "${COMPRESS}" --grep=needle grep/b.Z; then false; fi
+rm -r grep
+
+: "### Check concatenation"
+cp $COMPRESS input.new
+compress -f -c input >a.Z
+compress -c input.new >b.Z
+compress -b 12 -c input.new >c.Z
+compress --concat both.Z a.Z b.Z c.Z
+uncompress -c both.Z >both
+cat input input.new input.new | cmp - both
+if compress --concat both.Z a.Z; then false; fi
+rm a.Z b.Z c.Z both.Z both input.new
+
+: "### Check appending"
+head -c 50000 $COMPRESS >input.new
+compress -f -b 12 -c input >a.Z
+compress -b 12 --append a.Z <input.new
+cat input input.new | compress -f -b 12 -c | cmp - a.Z
+compress -c --index input.new >b.Z
+if compress --append b.Z <input; then false; fi
+rm a.Z b.Z input.new
+
+: "### Check flexible parsing"
+awk 'BEGIN { for (i = 0; i < 100000; i++) printf "%d %s\n", i * 7 % 1000,
+	substr("the quick brown fox jumps over the lazy dog", i % 23 + 1, i % 11 + 5) }' >input.new
+compress -c --best input.new >best.Z
+uncompress -c best.Z | cmp - input.new
+compress -c --best --index input.new | uncompress -c | cmp - input.new
+rm input.new best.Z
+
+: "### Check rate limit"
+compress -c --rate-limit=100 $COMPRESS >input.Z
+uncompress -c --rate-limit=0.5 input.Z | cmp - $COMPRESS
+if compress -c --rate-limit=0 $COMPRESS >/dev/null; then false; fi
+rm input.Z
+
+: "### Check page cache hints"
+for i in 1 2 3 4 5 6 7 8 9 10; do cat $COMPRESS; done >input.new
+cp input.new input.orig
+compress --nocache input.new
+uncompress --nocache input.new.Z
+cmp input.new input.orig
+compress -c --nocache <input.orig | uncompress -c --nocache | cmp - input.orig
+rm input.new input.orig
+
+: "### Check automatic code width"
+for i in 1 2 3; do cat $COMPRESS; done >input.new
+compress -v -b auto input.new 2>msg
+bits=$(sed -n 's/.*Bits: \([0-9]*\).*/\1/p' msg)
+[ -n "${bits}" ]
+uncompress -c input.new.Z >input.orig
+compress -c -b "${bits}" input.orig | cmp - input.new.Z
+compress -c -b auto -j 4 input.orig | cmp - input.new.Z
+compress -c -b auto -j 4 -M 100k input.orig | uncompress -c | cmp - input.orig
+rm input.new.Z input.orig msg
+
+: "### Check resume"
+# About 8MB that compresses to well over the 2000 blocks ulimit allows, and
+# changes format often enough for table resets, and so checkpoints, below it
+awk 'BEGIN { srand(1); for (i = 0; i < 500000; i++)
+	printf (int(i / 20000) % 2 ? "%x-%x\n" : "%d %d\n"), i, rand() * 1000000000 }' >input.new
+compress -c input.new >input.ref.Z
+if (ulimit -f 2000 && compress --resume input.new) 2>/dev/null; then false; fi
+compress -f --resume input.new
+cmp input.new.Z input.ref.Z
+uncompress --resume input.new.Z
+compress -c input.new | cmp - input.ref.Z
+[ ! -e input.new.Z.resume ] && [ ! -e input.new.resume ]
+if (ulimit -f 2000 && compress --resume input.new) 2>/dev/null; then false; fi
+if compress -b 12 --resume input.new 2>/dev/null; then false; fi
+[ ! -e input.new.Z.resume ] && [ -e input.new.Z ]
+compress -f -b 12 --resume input.new
+uncompress -c input.new.Z | compress -c -b 12 | cmp - input.new.Z
+[ ! -e input.new.Z.resume ]
+rm input.new.Z input.ref.Z
+
+: "### Check splitting"
+# About 8MB, so several segments of --index whatever the size of compress
+awk 'BEGIN { srand(1); for (i = 0; i < 500000; i++) printf "%d %d\n", i, rand() * 1000000000 }' >input.new
+compress -c --index input.new >split.Z
+compress --split=3 split.Z >manifest
+[ "$(wc -l <manifest)" -eq 3 ]
+for f in split.1.Z split.2.Z split.3.Z; do uncompress -c $f; done | cmp - input.new
+if compress --split=3 split.Z >/dev/null; then false; fi
+rm split.Z split.[123].Z manifest input.new
+
+: "### Check synced output"
+mkdir sync
+for f in a b c; do cp input "sync/${f}"; done
+echo old >sync/c.Z
+compress -f --sync=2 sync/a sync/b sync/c
+[ ! -e sync/a ] && [ ! -e sync/c ]
+uncompress -c sync/c.Z | cmp - input
+uncompress --sync sync/*.Z
+[ "$(ls sync)" = "$(printf 'a\nb\nc')" ]
+rm -r sync
+
 : "### All passed!"